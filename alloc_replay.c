@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "a.h"
+#include "mem.h"
+#include "sys.h"
+#include "slab.h"
+#include "alloc_trace.h"
+
+/* replays an allocation trace (see alloc_trace.h) against slab_alloc(),
+ * mem_alloc() or plain malloc(), and reports throughput, peak RSS and
+ * fragmentation:
+
+ *   alloc_replay <trace> slab|mem|malloc
+ *   alloc_replay -synth <trace>    (writes a synthetic trace to replay)
+
+ * events are replayed in recorded order on a single thread, whichever thread
+ * recorded them, and without the recorded delays. every allocation has one
+ * byte per page written so its memory is committed like the real thing */
+
+enum {
+	REPLAY_SLAB,
+	REPLAY_MEM,
+	REPLAY_MALLOC,
+};
+
+static int allocator;
+
+static void* replay_alloc(size_t sz)
+{
+	switch (allocator) {
+	case REPLAY_SLAB: return slab_alloc(sz);
+	case REPLAY_MEM: return mem_alloc(sz);
+	case REPLAY_MALLOC: return malloc(sz);
+	}
+	WRONG("unknown allocator");
+}
+
+static void replay_free(void* p)
+{
+	switch (allocator) {
+	case REPLAY_SLAB: slab_free(p); return;
+	case REPLAY_MEM: mem_free(p); return;
+	case REPLAY_MALLOC: free(p); return;
+	}
+	WRONG("unknown allocator");
+}
+
+// slab has no realloc; do what a caller would
+static void* replay_realloc(void* p, size_t old_sz, size_t sz)
+{
+	switch (allocator) {
+	case REPLAY_SLAB: {
+		void* p2 = slab_alloc(sz);
+		memcpy(p2, p, old_sz < sz ? old_sz : sz);
+		slab_free(p);
+		return p2;
+	}
+	case REPLAY_MEM: return mem_realloc(p, sz);
+	case REPLAY_MALLOC: return realloc(p, sz);
+	}
+	WRONG("unknown allocator");
+}
+
+static inline void touch(void* p, size_t sz)
+{
+	for (size_t o = 0; o < sz; o += 4096) ((volatile uint8_t*)p)[o] = ((volatile uint8_t*)p)[o];
+}
+
+/* recorded pointer -> replayed allocation. open addressing with linear
+ * probing and backward shift deletion; sized up front for the worst case
+ * (every allocation live at once) so it never grows during the replay */
+struct live {
+	uint64_t key; // 0 if empty
+	void* p;
+	size_t sz;
+};
+
+static struct live* lives;
+static size_t lives_mask;
+
+static inline size_t live_hash(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 20;
+}
+
+static struct live* live_find(uint64_t key)
+{
+	for (size_t i = live_hash(key);; i++) {
+		struct live* l = &lives[i & lives_mask];
+		if (l->key == key) return l;
+		if (l->key == 0) return NULL;
+	}
+}
+
+static struct live* live_insert(uint64_t key)
+{
+	for (size_t i = live_hash(key);; i++) {
+		struct live* l = &lives[i & lives_mask];
+		if (l->key == 0) {
+			l->key = key;
+			return l;
+		}
+		ASSERT(l->key != key);
+	}
+}
+
+static void live_remove(struct live* l)
+{
+	size_t i = l - lives;
+	l->key = 0;
+	for (size_t j = (i + 1) & lives_mask; lives[j].key != 0; j = (j + 1) & lives_mask) {
+		// entries between their home slot and j stay put
+		size_t home = live_hash(lives[j].key) & lives_mask;
+		if (((j - home) & lives_mask) < ((j - i) & lives_mask)) continue;
+		lives[i] = lives[j];
+		lives[j].key = 0;
+		i = j;
+	}
+}
+
+static size_t rss_bytes()
+{
+	FILE* f = fopen("/proc/self/statm", "r");
+	AN(f);
+	long size, resident;
+	ASSERT(fscanf(f, "%ld %ld", &size, &resident) == 2);
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t peak_rss_bytes()
+{
+	struct rusage ru;
+	AZ(getrusage(RUSAGE_SELF, &ru));
+	return (size_t)ru.ru_maxrss * 1024;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int replay(const char* path)
+{
+	struct sys_mmap_file mf;
+	if (sys_mmap_file_ro(&mf, path) == -1) {
+		fprintf(stderr, "%s: could not open\n", path);
+		return EXIT_FAILURE;
+	}
+	struct alloc_trace_header* header = mf.ptr;
+	if (mf.sz < sizeof(*header) || header->magic != ALLOC_TRACE_MAGIC || header->version != ALLOC_TRACE_VERSION || header->event_size != sizeof(struct alloc_trace_event)) {
+		fprintf(stderr, "%s: not an allocation trace (or wrong version)\n", path);
+		return EXIT_FAILURE;
+	}
+	struct alloc_trace_event* events = (struct alloc_trace_event*)(header + 1);
+	size_t n_events = (mf.sz - sizeof(*header)) / sizeof(*events);
+
+	size_t n_allocs = 0;
+	uint64_t duration_us = 0;
+	for (size_t i = 0; i < n_events; i++) {
+		if (events[i].op != ALLOC_TRACE_FREE) n_allocs++;
+		duration_us += events[i].dt_us;
+	}
+	size_t cap = 1024;
+	while (cap < n_allocs * 2) cap <<= 1;
+	lives = calloc(cap, sizeof(*lives));
+	AN(lives);
+	lives_mask = cap - 1;
+
+	// fault in the table and the trace so the baseline covers them
+	touch(lives, cap * sizeof(*lives));
+	volatile uint64_t sum = 0;
+	for (size_t i = 0; i < n_events; i++) sum += events[i].sz;
+
+	size_t baseline_rss = rss_bytes();
+	size_t n_unmatched = 0;
+	size_t live_bytes = 0, peak_live_bytes = 0;
+
+	double t0 = now();
+	for (size_t i = 0; i < n_events; i++) {
+		struct alloc_trace_event* e = &events[i];
+		switch (e->op) {
+		case ALLOC_TRACE_ALLOC: {
+			struct live* l = live_find(e->ptr);
+			if (l != NULL) {
+				// a free was lost (e.g. recorded after a racing alloc); drop ours
+				n_unmatched++;
+				live_bytes -= l->sz;
+				replay_free(l->p);
+				live_remove(l);
+			}
+			l = live_insert(e->ptr);
+			l->sz = e->sz;
+			l->p = replay_alloc(e->sz);
+			touch(l->p, e->sz);
+			live_bytes += e->sz;
+		} break;
+		case ALLOC_TRACE_FREE: {
+			struct live* l = live_find(e->ptr);
+			if (l == NULL) {
+				// allocated before tracing started
+				n_unmatched++;
+				break;
+			}
+			live_bytes -= l->sz;
+			replay_free(l->p);
+			live_remove(l);
+		} break;
+		case ALLOC_TRACE_REALLOC: {
+			struct live* old = e->old_ptr ? live_find(e->old_ptr) : NULL;
+			void* p;
+			if (old != NULL) {
+				live_bytes -= old->sz;
+				p = replay_realloc(old->p, old->sz, e->sz);
+				live_remove(old);
+			} else {
+				if (e->old_ptr) n_unmatched++;
+				p = replay_alloc(e->sz);
+			}
+			struct live* l = live_find(e->ptr);
+			if (l != NULL) {
+				n_unmatched++;
+				live_bytes -= l->sz;
+				replay_free(l->p);
+				live_remove(l);
+			}
+			l = live_insert(e->ptr);
+			l->p = p;
+			l->sz = e->sz;
+			touch(p, e->sz);
+			live_bytes += e->sz;
+		} break;
+		default:
+			fprintf(stderr, "%s: bad event %zd\n", path, i);
+			return EXIT_FAILURE;
+		}
+		if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+	}
+	double dt = now() - t0;
+
+	size_t peak_rss = peak_rss_bytes();
+	peak_rss = peak_rss > baseline_rss ? peak_rss - baseline_rss : 0;
+	size_t end_rss = rss_bytes();
+	end_rss = end_rss > baseline_rss ? end_rss - baseline_rss : 0;
+
+	printf("%zd events (%.1f s recorded), %zd unmatched\n", n_events, duration_us * 1e-6, n_unmatched);
+	printf("  throughput:     %.1f M events/s (%.1f ns/event)\n", n_events / dt * 1e-6, dt * 1e9 / n_events);
+	printf("  peak live:      %8.1f MiB requested\n", peak_live_bytes / 1048576.0);
+	printf("  peak RSS:       %8.1f MiB above baseline\n", peak_rss / 1048576.0);
+	if (peak_live_bytes > 0) {
+		printf("  fragmentation:  %.2fx (peak RSS / peak live)\n", (double)peak_rss / peak_live_bytes);
+	}
+	printf("  live at end:    %8.1f MiB requested, %.1f MiB RSS above baseline\n", live_bytes / 1048576.0, end_rss / 1048576.0);
+
+	sys_munmap_file(&mf);
+	return EXIT_SUCCESS;
+}
+
+// xorshift; deterministic so traces are comparable
+static uint32_t rng_state = 2463534242u;
+static inline uint32_t rng()
+{
+	uint32_t x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rng_state = x;
+}
+
+// mostly small objects, a long tail up to a few hundred KiB
+static size_t synth_size()
+{
+	int k = 3 + rng() % 9;
+	if ((rng() & 63) == 0) k += 6;
+	return ((size_t)1 << k) + rng() % ((size_t)1 << k);
+}
+
+#define SYNTH_ROUNDS (64)
+#define SYNTH_LIVE (16384)
+#define SYNTH_CHURN (8192)
+
+/* a workload shaped like a frame loop: a long-lived set of objects slowly
+ * churned, a burst of temporaries per round freed in bulk, and a few growing
+ * buffers */
+static int synth(const char* path)
+{
+	if (alloc_trace_start(path) == -1) {
+		fprintf(stderr, "%s: could not open for writing\n", path);
+		return EXIT_FAILURE;
+	}
+
+	static void* slab_live[SYNTH_LIVE];
+	static void* mem_live[SYNTH_LIVE / 4];
+	static void* temps[SYNTH_CHURN];
+	void* buffers[8];
+	size_t buffer_sizes[8];
+	for (int i = 0; i < 8; i++) {
+		buffer_sizes[i] = 64;
+		buffers[i] = mem_alloc(buffer_sizes[i]);
+	}
+	for (int i = 0; i < SYNTH_LIVE; i++) slab_live[i] = slab_alloc(synth_size());
+	for (int i = 0; i < SYNTH_LIVE / 4; i++) mem_live[i] = mem_alloc(synth_size());
+
+	for (int round = 0; round < SYNTH_ROUNDS; round++) {
+		for (int i = 0; i < SYNTH_CHURN; i++) temps[i] = slab_alloc(1 + (synth_size() & 1023));
+		for (int i = 0; i < SYNTH_LIVE / 16; i++) {
+			int j = rng() % SYNTH_LIVE;
+			slab_free(slab_live[j]);
+			slab_live[j] = slab_alloc(synth_size());
+		}
+		for (int i = 0; i < SYNTH_LIVE / 64; i++) {
+			int j = rng() % (SYNTH_LIVE / 4);
+			mem_free(mem_live[j]);
+			mem_live[j] = mem_alloc(synth_size());
+		}
+		int b = rng() % 8;
+		buffer_sizes[b] += buffer_sizes[b] / 2;
+		buffers[b] = mem_realloc(buffers[b], buffer_sizes[b]);
+		slab_free_many(temps, SYNTH_CHURN);
+	}
+
+	for (int i = 0; i < SYNTH_LIVE; i++) slab_free(slab_live[i]);
+	for (int i = 0; i < SYNTH_LIVE / 4; i++) mem_free(mem_live[i]);
+	for (int i = 0; i < 8; i++) mem_free(buffers[i]);
+
+	alloc_trace_stop();
+	return EXIT_SUCCESS;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s <trace> slab|mem|malloc\n", argv0);
+	fprintf(stderr, "       %s -synth <trace>\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc != 3) usage(argv[0]);
+	if (strcmp(argv[1], "-synth") == 0) return synth(argv[2]);
+
+	if (strcmp(argv[2], "slab") == 0) {
+		allocator = REPLAY_SLAB;
+	} else if (strcmp(argv[2], "mem") == 0) {
+		allocator = REPLAY_MEM;
+	} else if (strcmp(argv[2], "malloc") == 0) {
+		allocator = REPLAY_MALLOC;
+	} else {
+		usage(argv[0]);
+	}
+	return replay(argv[1]);
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "unittest.h"
+
+#include "a.h"
+#include "alloc_trace.h"
+
+/* events are buffered and written in blocks. the recorder must not
+ * allocate through mem.c or slab.c itself */
+#define BUFFER_EVENTS (4096)
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* trace_file; // guarded by trace_lock; read unlocked as an "on" flag
+static struct alloc_trace_event buffer[BUFFER_EVENTS];
+static int n_buffered;
+static uint64_t last_us;
+static int n_threads;
+static __thread int thread_number; // 1-based; 0 until the thread's first event
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void flush_locked()
+{
+	if (n_buffered == 0) return;
+	ASSERT(fwrite(buffer, sizeof(*buffer), n_buffered, trace_file) == n_buffered);
+	n_buffered = 0;
+}
+
+int alloc_trace_start(const char* path)
+{
+	pthread_mutex_lock(&trace_lock);
+	AZ(trace_file);
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+	struct alloc_trace_header header = {
+		.magic = ALLOC_TRACE_MAGIC,
+		.version = ALLOC_TRACE_VERSION,
+		.event_size = sizeof(struct alloc_trace_event),
+	};
+	ASSERT(fwrite(&header, sizeof(header), 1, f) == 1);
+	n_buffered = 0;
+	last_us = now_us();
+	__atomic_store_n(&trace_file, f, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+void alloc_trace_stop()
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file != NULL) {
+		flush_locked();
+		fclose(trace_file);
+		__atomic_store_n(&trace_file, NULL, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void alloc_trace_record(int op, int allocator, uintptr_t ptr, uintptr_t old_ptr, size_t sz)
+{
+	if (__atomic_load_n(&trace_file, __ATOMIC_RELAXED) == NULL) return;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	if (thread_number == 0) thread_number = ++n_threads;
+
+	uint64_t t = now_us();
+	uint64_t dt = t - last_us;
+	last_us = t;
+
+	struct alloc_trace_event* e = &buffer[n_buffered++];
+	e->dt_us = dt > UINT32_MAX ? UINT32_MAX : dt;
+	e->op = op;
+	e->allocator = allocator;
+	e->thread = thread_number > UINT16_MAX ? UINT16_MAX : thread_number;
+	e->sz = sz;
+	e->ptr = ptr;
+	e->old_ptr = old_ptr;
+	if (n_buffered == BUFFER_EVENTS) flush_locked();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+
+#ifdef UNITTEST
+
+#include <stdlib.h>
+
+#define TEST_PATH "test_alloc_trace.tmp"
+
+static struct alloc_trace_event* read_trace(int* n)
+{
+	FILE* f = fopen(TEST_PATH, "rb");
+	AN(f);
+	struct alloc_trace_header header;
+	ASSERT(fread(&header, sizeof(header), 1, f) == 1);
+	ASSERT(header.magic == ALLOC_TRACE_MAGIC);
+	ASSERT(header.version == ALLOC_TRACE_VERSION);
+	ASSERT(header.event_size == sizeof(struct alloc_trace_event));
+	fseek(f, 0, SEEK_END);
+	long sz = ftell(f) - sizeof(header);
+	ASSERT(sz % sizeof(struct alloc_trace_event) == 0);
+	*n = sz / sizeof(struct alloc_trace_event);
+	fseek(f, sizeof(header), SEEK_SET);
+	struct alloc_trace_event* events = malloc(sz + 1);
+	AN(events);
+	ASSERT(fread(events, sizeof(*events), *n, f) == *n);
+	fclose(f);
+	return events;
+}
+
+static void test_record()
+{
+	alloc_trace_record(ALLOC_TRACE_ALLOC, ALLOC_TRACE_MEM, 0x1000, 0, 10); // not started; dropped
+	AZ(alloc_trace_start(TEST_PATH));
+	alloc_trace_record(ALLOC_TRACE_ALLOC, ALLOC_TRACE_MEM, 0x1000, 0, 100);
+	alloc_trace_record(ALLOC_TRACE_REALLOC, ALLOC_TRACE_MEM, 0x2000, 0x1000, 200);
+	alloc_trace_record(ALLOC_TRACE_ALLOC, ALLOC_TRACE_SLAB, 0x3000, 0, 48);
+	alloc_trace_record(ALLOC_TRACE_FREE, ALLOC_TRACE_SLAB, 0x3000, 0, 0);
+	alloc_trace_record(ALLOC_TRACE_FREE, ALLOC_TRACE_MEM, 0x2000, 0, 0);
+	alloc_trace_stop();
+	alloc_trace_record(ALLOC_TRACE_ALLOC, ALLOC_TRACE_MEM, 0x1000, 0, 10); // stopped; dropped
+
+	int n;
+	struct alloc_trace_event* e = read_trace(&n);
+	ASSERT(n == 5);
+	ASSERT(e[0].op == ALLOC_TRACE_ALLOC && e[0].allocator == ALLOC_TRACE_MEM && e[0].ptr == 0x1000 && e[0].sz == 100);
+	ASSERT(e[1].op == ALLOC_TRACE_REALLOC && e[1].ptr == 0x2000 && e[1].old_ptr == 0x1000 && e[1].sz == 200);
+	ASSERT(e[2].allocator == ALLOC_TRACE_SLAB && e[2].sz == 48);
+	ASSERT(e[3].op == ALLOC_TRACE_FREE && e[3].ptr == 0x3000);
+	ASSERT(e[4].op == ALLOC_TRACE_FREE && e[4].ptr == 0x2000);
+	for (int i = 0; i < n; i++) ASSERT(e[i].thread == 1);
+	free(e);
+	remove(TEST_PATH);
+}
+
+#define THREAD_EVENTS (BUFFER_EVENTS + 100)
+
+static void* record_worker(void* arg)
+{
+	for (int i = 0; i < THREAD_EVENTS; i++) {
+		alloc_trace_record(ALLOC_TRACE_ALLOC, ALLOC_TRACE_SLAB, i + 1, 0, (uintptr_t)arg);
+	}
+	return NULL;
+}
+
+static void test_record_threads()
+{
+	AZ(alloc_trace_start(TEST_PATH));
+	pthread_t threads[2];
+	for (int i = 0; i < 2; i++) AZ(pthread_create(&threads[i], NULL, record_worker, (void*)(uintptr_t)(i + 1)));
+	for (int i = 0; i < 2; i++) AZ(pthread_join(threads[i], NULL));
+	alloc_trace_stop();
+
+	int n;
+	struct alloc_trace_event* e = read_trace(&n);
+	ASSERT(n == 2 * THREAD_EVENTS);
+	// events of each thread are in order, and threads are told apart
+	uint64_t next[3] = { 0, 1, 1 };
+	int thread_of_sz[3] = { 0, 0, 0 };
+	for (int i = 0; i < n; i++) {
+		int sz = e[i].sz;
+		ASSERT(sz == 1 || sz == 2);
+		ASSERT(e[i].ptr == next[sz]++);
+		if (thread_of_sz[sz] == 0) thread_of_sz[sz] = e[i].thread;
+		ASSERT(e[i].thread == thread_of_sz[sz]);
+	}
+	ASSERT(thread_of_sz[1] != thread_of_sz[2]);
+	free(e);
+	remove(TEST_PATH);
+}
+
+void pre_test()
+{
+	n_threads = 0;
+	thread_number = 0;
+}
+
+void post_test()
+{
+	AZ(trace_file);
+}
+
+void run_tests()
+{
+	TEST(test_record);
+	TEST(test_record_threads);
+}
+
+#endif
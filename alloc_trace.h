@@ -0,0 +1,54 @@
+#ifndef ALLOC_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* allocation tracing. when built with -DALLOC_TRACE, mem.c and slab.c log
+ * every alloc, free and realloc made between alloc_trace_start() and
+ * alloc_trace_stop() to a binary trace file, for replaying a real session
+ * against different allocators (see alloc_replay.c). the file is a struct
+ * alloc_trace_header followed by struct alloc_trace_events */
+
+#define ALLOC_TRACE_MAGIC (0x45434152544c4c41ull) // "ALLTRACE"
+#define ALLOC_TRACE_VERSION (1)
+
+enum {
+	ALLOC_TRACE_ALLOC = 1,
+	ALLOC_TRACE_FREE,
+	ALLOC_TRACE_REALLOC,
+};
+
+enum {
+	ALLOC_TRACE_MEM = 1,
+	ALLOC_TRACE_SLAB,
+};
+
+struct alloc_trace_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t event_size;
+};
+
+struct alloc_trace_event {
+	uint32_t dt_us; // since the previous event; saturates
+	uint8_t op;
+	uint8_t allocator;
+	uint16_t thread; // numbered in order of first event
+	uint64_t sz; // requested size; 0 for frees
+	uint64_t ptr; // allocated pointer, or freed pointer for frees
+	uint64_t old_ptr; // reallocs only
+};
+
+// returns -1 if path can't be opened for writing
+int alloc_trace_start(const char* path);
+void alloc_trace_stop();
+void alloc_trace_record(int op, int allocator, uintptr_t ptr, uintptr_t old_ptr, size_t sz);
+
+#ifdef ALLOC_TRACE
+#define ALLOC_TRACE_EVENT(op, allocator, ptr, old_ptr, sz) alloc_trace_record(ALLOC_TRACE_ ## op, ALLOC_TRACE_ ## allocator, (uintptr_t)(ptr), (uintptr_t)(old_ptr), sz)
+#else
+#define ALLOC_TRACE_EVENT(op, allocator, ptr, old_ptr, sz)
+#endif
+
+#define ALLOC_TRACE_H
+#endif
@@ -0,0 +1,45 @@
+#ifdef BENCHMARK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* benchmarks live at the bottom of the module they measure, inside
+ * #ifdef BENCHMARK, and are registered in run_benchmarks() with BENCH().
+ * built with optimizations and linked against the real mem.c/a.c */
+
+static inline double bench_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// xorshift; deterministic so runs are comparable
+static uint32_t bench_rng_state = 2463534242u;
+static inline uint32_t bench_rng()
+{
+	uint32_t x = bench_rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return bench_rng_state = x;
+}
+
+void run_benchmarks();
+
+#define BENCH(fn) \
+	do { \
+		printf("== " #fn "\n"); \
+		bench_rng_state = 2463534242u; \
+		fn(); \
+	} while (0);
+
+int main(int argc, char** argv)
+{
+	run_benchmarks();
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -1,9 +1,14 @@
 #ifndef D_H
 
+#include <stddef.h>
+#include <stdarg.h>
+
 #include "m.h"
 
-#ifdef USE_GL
+#if defined(USE_GL)
 #include <GL/gl.h>
+#elif defined(USE_SOFT)
+#include <stdint.h>
 #else
 #error "implementation missing"
 #endif
@@ -16,12 +21,24 @@ struct d_texture {
 	GLuint texture;
 	uint64_t draw_tag;
 	#endif
+	#if USE_SOFT
+	uint8_t* pixels; // RGBA, premultiplied
+	#endif
 };
 
 // counter that increments every frame
 void d_inc_frame_tag();
 uint64_t d_get_frame_tag();
 
+/* frame arena, for transient data (formatted strings, layout results, draw
+ * inputs). allocations stay valid until the end of the next frame, i.e.
+ * until the second d_inc_frame_tag() from now, and are then freed in bulk.
+ * main thread only. the printfs return NULL on format errors */
+void* d_frame_alloc(size_t sz);
+void* d_frame_calloc(size_t sz);
+char* d_frame_printf(const char* fmt, ...) __attribute__ ((format (printf, 1, 2)));
+char* d_frame_vprintf(const char* fmt, va_list args);
+
 // textures
 void d_texture_init(struct d_texture*, int width, int height);
 void d_texture_free(struct d_texture*);
@@ -36,12 +53,88 @@ static inline void d_texture_get_uv(struct d_texture* t, int x, int y, float* u,
 
 
 // drawing
-void d_begin(int win_id);
+
+/* d_begin() returns 0 if nothing is damaged (see below), in which case the
+ * frame is skipped: don't draw, and don't call d_end() or d_flip(). d_flip()
+ * presents what the frame drew */
+int d_begin(int win_id);
 void d_end();
+void d_flip(int win_id);
+
+/* damage: window rectangles whose contents changed since the last frame.
+ * a frame only redraws and presents the damaged area; drawing is clipped to
+ * it and quads outside it are culled, so just draw the whole scene. the
+ * window starts out damaged, as it is after being resized. more than
+ * D_MAX_DAMAGE rectangles per frame are merged into their bounds */
+#define D_MAX_DAMAGE (16)
+void d_damage(int x, int y, int width, int height);
+void d_damage_all();
+
+/* whether the next frame has anything to draw, i.e. whether there's
+ * damage, or nothing was drawn yet. an app only needs to render (and wake
+ * up) when this is true or it's animating */
+int d_has_damage();
+
+#if USE_SOFT
+/* the software backend (d_soft.c) draws into an in-memory framebuffer
+ * instead of the window passed to d_begin(); set its size before the first
+ * d_begin(). d_soft_get_pixels() returns it as RGBA (premultiplied), rows
+ * top to bottom, width*4 bytes each; valid until the next d_soft_set_size() */
+void d_soft_set_size(int width, int height);
+uint8_t* d_soft_get_pixels(int* width, int* height);
+#endif
+
+/* heap allocations (mem.c, slab.c and scratch growth) made by the main
+ * thread between the last d_begin() and d_end() */
+struct d_frame_allocs {
+	uint64_t n_mem, n_slab, n_scratch_grows;
+};
+void d_get_frame_allocs(struct d_frame_allocs*);
+
+/* what d_end() does about a frame that allocated. a warmed up app redrawing
+ * what it drew before shouldn't allocate at all, so WARN or ASSERT can
+ * enforce that once past startup */
+enum {
+	D_FRAME_ALLOCS_ALLOW = 0,
+	D_FRAME_ALLOCS_WARN,
+	D_FRAME_ALLOCS_ASSERT,
+};
+void d_set_frame_allocs_check(int mode);
+
+/* for backends (d_frame.c): d_init() calls d_frame_init(), d_begin() calls
+ * d_frame_allocs_begin() and d_end() calls d_frame_allocs_end() */
+void d_frame_init();
+void d_frame_allocs_begin();
+void d_frame_allocs_end();
+
+/* d_begin() calls d_damage_begin() with the window size and the age of its
+ * back buffer (in frames; 1 if it holds the last frame, 0 if unknown), and
+ * skips the frame if it returns 0. the frame's damage is then available
+ * from d_get_damage(), as rectangles (boxes, x1/y1 exclusive) and their
+ * bounds, until the next d_damage_begin(). d_end() calls d_damage_end().
+ * back buffers up to D_DAMAGE_HISTORY frames old are redrawn from kept
+ * damage, so a frame has at most D_MAX_FRAME_DAMAGE boxes */
+struct d_box {
+	int x0, y0, x1, y1;
+};
+#define D_DAMAGE_HISTORY (4)
+#define D_MAX_FRAME_DAMAGE (D_MAX_DAMAGE + D_DAMAGE_HISTORY)
+int d_damage_begin(int width, int height, int buffer_age);
+void d_damage_end();
+const struct d_box* d_get_damage(int* n, struct d_box* bounds);
 
 void d_set_color(union vec4 color);
 void d_set_vertical_shade(union vec4 color0, union vec4 color1);
 
+/* layers: quads drawn between d_layer_begin() and d_layer_end() may be
+ * reordered to group them by texture, for fewer texture switches and draw
+ * calls, so only put quads in a layer if their relative order doesn't
+ * matter (e.g. they don't overlap). layers are drawn in submission order,
+ * relative to each other and to quads drawn outside layers. d_end() ends
+ * an open layer */
+void d_layer_begin();
+void d_layer_end();
+
 void d_rect(float x, float y, float width, float height);
 void d_blit(struct d_texture*, int sx, int sy, int sw, int sh, float dx, float dy);
 
@@ -4,9 +4,11 @@
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_MODULE_H
 
 #include "a.h"
 #include "d.h"
+#include "mem.h"
 #include "sys.h"
 #include "utf8_decode.h"
 
@@ -70,6 +72,29 @@ static struct {
 } state;
 
 
+/* FreeType allocates through mem.c, so glyph rendering counts as frame
+ * allocations too */
+static void* ft2_alloc(FT_Memory memory, long size)
+{
+	return mem_alloc(size);
+}
+
+static void ft2_free(FT_Memory memory, void* block)
+{
+	mem_free(block);
+}
+
+static void* ft2_realloc(FT_Memory memory, long cur_size, long new_size, void* block)
+{
+	return mem_realloc(block, new_size);
+}
+
+static struct FT_MemoryRec_ ft2_memory = {
+	.alloc = ft2_alloc,
+	.free = ft2_free,
+	.realloc = ft2_realloc
+};
+
 static int find_free_font_handle()
 {
 	for (int i = 0; i < MAX_FONT_HANDLES; i++) if (!fonts[i].open) return i;
@@ -91,7 +116,11 @@ static int open_font(char* path, int index, int size)
 	}
 
 	if (!state.ft2_init) {
-		AZ(FT_Init_FreeType(&state.ft2) != 0);
+		// FT_Init_FreeType(), with our allocator
+		AZ(FT_New_Library(&ft2_memory, &state.ft2));
+		FT_Add_Default_Modules(state.ft2);
+		FT_Set_Default_Properties(state.ft2);
+		state.ft2_init = 1;
 	}
 
 	int err = FT_New_Memory_Face(
@@ -125,17 +154,17 @@ static void reset_glyph_cache()
 	struct glyph_cache* gc = &state.glyph_cache;
 
 	if (!gc->initialized) {
-		if (gc->entry_keys != NULL) free(gc->entry_keys);
-		if (gc->entry_info != NULL) free(gc->entry_info);
-		if (gc->entry_tags != NULL) free(gc->entry_tags);
-		if (gc->entry_repack_indices != NULL) free(gc->entry_repack_indices);
+		mem_free(gc->entry_keys);
+		mem_free(gc->entry_info);
+		mem_free(gc->entry_tags);
+		mem_free(gc->entry_repack_indices);
 
 		struct d_texture* t = d_main_atlas_get_texture();
 		gc->max_entries = (t->width*t->height) / (4*4);
-		AN(gc->entry_keys = calloc(gc->max_entries, sizeof(*gc->entry_keys)));
-		AN(gc->entry_info = calloc(gc->max_entries, sizeof(*gc->entry_info)));
-		AN(gc->entry_tags = calloc(gc->max_entries, sizeof(*gc->entry_tags)));
-		AN(gc->entry_repack_indices = calloc(gc->max_entries, sizeof(*gc->entry_repack_indices)));
+		gc->entry_keys = mem_calloc(gc->max_entries * sizeof(*gc->entry_keys));
+		gc->entry_info = mem_calloc(gc->max_entries * sizeof(*gc->entry_info));
+		gc->entry_tags = mem_calloc(gc->max_entries * sizeof(*gc->entry_tags));
+		gc->entry_repack_indices = mem_calloc(gc->max_entries * sizeof(*gc->entry_repack_indices));
 	}
 
 	gc->n_entries = 0;
@@ -534,21 +563,20 @@ int d_str(int font_handle, char* str)
 
 int d_printf(int font_handle, const char* fmt, ...)
 {
-	char buffer[4096];
 	va_list args;
 	va_start(args, fmt);
-	int ret = vsnprintf(buffer, sizeof(buffer), fmt, args);
+	char* str = d_frame_vprintf(fmt, args);
 	va_end(args);
 
-	if (ret < 0) {
+	if (str == NULL) {
 		return -1;
 	}
 
-	int n = ret >= sizeof(buffer) ? sizeof(buffer)-1 : ret;
-	if (draw_string_n(font_handle, n, buffer) == -1) {
+	int n = strlen(str);
+	if (draw_string_n(font_handle, n, str) == -1) {
 		return -1;
 	}
 
-	return ret;
+	return n;
 }
 
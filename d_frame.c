@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+
+#include "scratch.h"
+#include "mem.h"
+#include "slab.h"
+#include "log.h"
+#include "a.h"
+#include "d.h"
+
+/* the backend independent parts of d.h: frame tag, frame arena, frame
+ * allocation checks and damage tracking */
+
+static uint64_t frame_tag;
+
+// frame arenas; the one for this frame is frame_scratches[frame_tag & 1]
+static struct scratch frame_scratches[2];
+
+static struct {
+	struct d_frame_allocs at_begin, last;
+	int check;
+} frame_allocs;
+
+static struct {
+	int width, height; // of the last frame
+
+	// since the last frame
+	int n;
+	struct d_box boxes[D_MAX_DAMAGE];
+
+	/* bounds of the damage of the last n_history frames, most recent
+	 * first; for back buffers older than the last frame */
+	int n_history;
+	struct d_box history[D_DAMAGE_HISTORY];
+
+	// this frame's, i.e. the above plus history as the back buffer needs
+	int n_frame;
+	struct d_box frame[D_MAX_FRAME_DAMAGE];
+	struct d_box bounds;
+} damage;
+
+static void get_allocs(struct d_frame_allocs* a)
+{
+	a->n_mem = mem_thread_allocs();
+	a->n_slab = slab_thread_allocs();
+	a->n_scratch_grows = scratch_thread_grows();
+}
+
+void d_frame_init()
+{
+	for (int i = 0; i < 2; i++) scratch_init(&frame_scratches[i], 0);
+}
+
+void d_inc_frame_tag()
+{
+	frame_tag++;
+	// what's in it was allocated two frames ago
+	scratch_set_top(&frame_scratches[frame_tag & 1], 0);
+}
+
+void* d_frame_alloc(size_t sz)
+{
+	return scratch_alloc_ptr(&frame_scratches[frame_tag & 1], sz);
+}
+
+void* d_frame_calloc(size_t sz)
+{
+	return scratch_calloc_ptr(&frame_scratches[frame_tag & 1], sz);
+}
+
+char* d_frame_vprintf(const char* fmt, va_list args)
+{
+	va_list args2;
+	va_copy(args2, args);
+	int n = vsnprintf(NULL, 0, fmt, args2);
+	va_end(args2);
+	if (n < 0) return NULL;
+	char* str = d_frame_alloc(n + 1);
+	vsnprintf(str, n + 1, fmt, args);
+	return str;
+}
+
+char* d_frame_printf(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	char* str = d_frame_vprintf(fmt, args);
+	va_end(args);
+	return str;
+}
+
+uint64_t d_get_frame_tag()
+{
+	return frame_tag;
+}
+
+void d_frame_allocs_begin()
+{
+	get_allocs(&frame_allocs.at_begin);
+}
+
+void d_frame_allocs_end()
+{
+	struct d_frame_allocs now;
+	get_allocs(&now);
+	struct d_frame_allocs* f = &frame_allocs.last;
+	f->n_mem = now.n_mem - frame_allocs.at_begin.n_mem;
+	f->n_slab = now.n_slab - frame_allocs.at_begin.n_slab;
+	f->n_scratch_grows = now.n_scratch_grows - frame_allocs.at_begin.n_scratch_grows;
+	switch (frame_allocs.check) {
+	case D_FRAME_ALLOCS_WARN:
+		if (f->n_mem || f->n_slab || f->n_scratch_grows) {
+			warnf("frame %lu allocated: %lu mem, %lu slab, %lu scratch grows",
+				frame_tag, f->n_mem, f->n_slab, f->n_scratch_grows);
+		}
+		break;
+	case D_FRAME_ALLOCS_ASSERT:
+		AZ(f->n_mem);
+		AZ(f->n_slab);
+		AZ(f->n_scratch_grows);
+		break;
+	}
+}
+
+void d_get_frame_allocs(struct d_frame_allocs* f)
+{
+	*f = frame_allocs.last;
+}
+
+void d_set_frame_allocs_check(int mode)
+{
+	frame_allocs.check = mode;
+}
+
+static inline int box_is_empty(struct d_box b)
+{
+	return b.x0 >= b.x1 || b.y0 >= b.y1;
+}
+
+static inline struct d_box box_union(struct d_box a, struct d_box b)
+{
+	if (box_is_empty(a)) return b;
+	if (box_is_empty(b)) return a;
+	return (struct d_box) {
+		.x0 = a.x0 < b.x0 ? a.x0 : b.x0,
+		.y0 = a.y0 < b.y0 ? a.y0 : b.y0,
+		.x1 = a.x1 > b.x1 ? a.x1 : b.x1,
+		.y1 = a.y1 > b.y1 ? a.y1 : b.y1,
+	};
+}
+
+static inline struct d_box box_clip(struct d_box b, int width, int height)
+{
+	if (b.x0 < 0) b.x0 = 0;
+	if (b.y0 < 0) b.y0 = 0;
+	if (b.x1 > width) b.x1 = width;
+	if (b.y1 > height) b.y1 = height;
+	return b;
+}
+
+static void add_frame_damage(struct d_box b)
+{
+	b = box_clip(b, damage.width, damage.height);
+	if (box_is_empty(b)) return;
+	damage.frame[damage.n_frame++] = b;
+	damage.bounds = box_union(damage.bounds, b);
+}
+
+void d_damage(int x, int y, int width, int height)
+{
+	if (width <= 0 || height <= 0) return;
+	struct d_box b = { .x0 = x, .y0 = y, .x1 = x + width, .y1 = y + height };
+	if (damage.n == D_MAX_DAMAGE) {
+		for (int i = 1; i < damage.n; i++) b = box_union(b, damage.boxes[i]);
+		damage.boxes[0] = box_union(b, damage.boxes[0]);
+		damage.n = 1;
+		return;
+	}
+	damage.boxes[damage.n++] = b;
+}
+
+void d_damage_all()
+{
+	damage.n = 0;
+	d_damage(INT_MIN / 2, INT_MIN / 2, INT_MAX, INT_MAX);
+}
+
+int d_has_damage()
+{
+	return damage.n > 0 || damage.width == 0;
+}
+
+int d_damage_begin(int width, int height, int buffer_age)
+{
+	if (width != damage.width || height != damage.height) {
+		damage.width = width;
+		damage.height = height;
+		d_damage_all();
+	}
+
+	damage.n_frame = 0;
+	damage.bounds = (struct d_box) {0};
+	if (damage.n == 0) return 0;
+
+	if (buffer_age < 1 || buffer_age - 1 > damage.n_history) {
+		// back buffer contents unknown (or too old); redraw everything
+		add_frame_damage((struct d_box) { .x0 = 0, .y0 = 0, .x1 = width, .y1 = height });
+	} else {
+		for (int i = 0; i < damage.n; i++) add_frame_damage(damage.boxes[i]);
+		for (int i = 0; i < buffer_age - 1; i++) add_frame_damage(damage.history[i]);
+	}
+	if (damage.n_frame == 0) {
+		// all outside the window; nothing to draw, now or later
+		damage.n = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void d_damage_end()
+{
+	struct d_box b = {0};
+	for (int i = 0; i < damage.n; i++) b = box_union(b, box_clip(damage.boxes[i], damage.width, damage.height));
+	memmove(damage.history + 1, damage.history, (D_DAMAGE_HISTORY - 1) * sizeof(*damage.history));
+	damage.history[0] = b;
+	if (damage.n_history < D_DAMAGE_HISTORY) damage.n_history++;
+	damage.n = 0;
+}
+
+const struct d_box* d_get_damage(int* n, struct d_box* bounds)
+{
+	if (n != NULL) *n = damage.n_frame;
+	if (bounds != NULL) *bounds = damage.bounds;
+	return damage.frame;
+}
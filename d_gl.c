@@ -1,9 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <math.h>
 
 #include "gl.h"
 
 #include "scratch.h"
+#include "mem.h"
 #include "a.h"
 #include "d.h"
 #include "win.h"
@@ -14,8 +17,24 @@ struct draw_vertex {
 	union vec4 color;
 };
 
+/* one quad per instance, expanded by the vertex shader; 24 bytes instead of
+ * 4 vertices and 6 elements (140 bytes). positions and sizes are in whole
+ * pixels, colors are for the top and bottom edge, as given to d_set_color() */
+struct draw_quad {
+	GLshort x, y, w, h;
+	GLushort u0, v0, u1, v1; // unorm16
+	uint8_t color0[4], color1[4]; // RGBA8
+};
+
+struct quad_colors {
+	union vec4 color0, color1;
+	uint8_t packed0[4], packed1[4]; // color0/color1 as RGBA8
+};
+
 struct texture_batch {
-	int n_elements;
+	int quads;
+	int n; // quads, or elements
+	int n_vertices;
 	GLuint texture;
 };
 
@@ -26,19 +45,50 @@ typedef GLushort ElementType;
 #define MAX_VERTICES (1<<16)
 #define MAX_ELEMENTS (1<<17)
 #define MAX_TEXTURE_BINDS (1<<12)
-
-static uint64_t frame_tag;
+#define VERTEX_SECTION_SIZE (MAX_VERTICES * sizeof(struct draw_vertex))
+#define MAX_QUADS ((int)(VERTEX_SECTION_SIZE / sizeof(struct draw_quad)))
+#define MAX_QUAD_ELEMENTS ((MAX_VERTICES / 4) * 6)
+
+/* vertices (or quads) and elements go into ring buffers of RING_SECTIONS
+ * sections, each holding VERTEX_SECTION_SIZE bytes of vertices or quads and
+ * MAX_ELEMENTS elements; every flush draws from the next free
+ * part of the current section, so a mid-frame flush doesn't make the driver
+ * wait for the previous draw. with ARB_buffer_storage the rings are mapped
+ * persistently, draw_append() writes straight into them, and a fence per
+ * section keeps us from overwriting what the GPU hasn't drawn yet. without
+ * it, batches are uploaded unsynchronized and the buffers are orphaned
+ * whenever the ring wraps */
+#define RING_SECTIONS (3)
 
 static struct {
 	GLuint prg;
 	GLuint u_texture;
 	GLuint u_scaling;
+	GLuint a_position, a_uv, a_color;
+	GLuint a_rect, a_uv_rect, a_color0, a_color1;
 	GLuint vertex_buffer;
 	GLuint vertex_array;
 	GLuint element_buffer;
-
+	GLuint quad_element_buffer;
+
+	/* quads are drawn instanced (GL 3.3) as struct draw_quads. otherwise
+	 * they're 4 struct draw_vertexs each, indexed by quad_element_buffer
+	 * (which never changes); only other geometry goes through the element
+	 * ring */
+	int instanced;
+	int vertex_size;
+	int max_vertices; // per section
+
+	int persistent; // rings are persistently mapped
+	uint8_t* vertex_map;
+	ElementType* element_map;
+	GLsync fences[RING_SECTIONS];
+	int section;
+	int section_vertices, section_elements; // used by batches already drawn
+
+	// current batch; points into the rings when persistent, else staging
 	int n_vertices;
-	struct draw_vertex* vertices;
+	void* vertices;
 
 	int n_elements;
 	ElementType* elements;
@@ -53,9 +103,99 @@ static struct {
 	int win_width;
 	int win_height;
 	uint64_t tag;
-	union vec4 color0, color1;
+	struct quad_colors colors;
+	struct d_box clip; // bounds of the frame's damage
 } draw_scope;
 
+/* quads drawn in a layer are recorded, and drawn sorted by texture (stable,
+ * by first use in the layer) when the layer ends. textures are counted per
+ * layer; a layer using more than LAYER_MAX_TEXTURES is drawn in parts */
+#define LAYER_MAX_TEXTURES (64)
+
+struct layer_quad {
+	struct d_texture* texture;
+	int slot; // index into layer.textures
+	float x0, y0, x1, y1, u0, v0, u1, v1;
+	struct quad_colors colors;
+};
+
+static struct {
+	int open;
+	int n, cap;
+	struct layer_quad* quads;
+	struct layer_quad* sorted;
+	int n_textures, last_slot;
+	struct d_texture* textures[LAYER_MAX_TEXTURES];
+	int offsets[LAYER_MAX_TEXTURES];
+} layer;
+
+/* what's currently bound, so redundant binds can be skipped. GL_NONE_BOUND
+ * means unknown. the element buffer binding is part of the vertex array's
+ * state */
+#define GL_NONE_BOUND ((GLuint)~0)
+static struct {
+	GLuint program;
+	GLuint vertex_array;
+	GLuint array_buffer;
+	GLuint element_buffer;
+	GLuint texture;
+} gl_state;
+
+static void gl_state_invalidate()
+{
+	gl_state.program = GL_NONE_BOUND;
+	gl_state.vertex_array = GL_NONE_BOUND;
+	gl_state.array_buffer = GL_NONE_BOUND;
+	gl_state.element_buffer = GL_NONE_BOUND;
+	gl_state.texture = GL_NONE_BOUND;
+}
+
+static inline void use_program(GLuint prg)
+{
+	if (gl_state.program == prg) return;
+	glUseProgram(prg); CHKGL;
+	gl_state.program = prg;
+}
+
+static inline void bind_vertex_array(GLuint vao)
+{
+	if (gl_state.vertex_array == vao) return;
+	glBindVertexArray(vao); CHKGL;
+	gl_state.vertex_array = vao;
+	gl_state.element_buffer = GL_NONE_BOUND;
+}
+
+static inline void bind_array_buffer(GLuint buffer)
+{
+	if (gl_state.array_buffer == buffer) return;
+	glBindBuffer(GL_ARRAY_BUFFER, buffer); CHKGL;
+	gl_state.array_buffer = buffer;
+}
+
+static inline void bind_element_buffer(GLuint buffer)
+{
+	if (gl_state.element_buffer == buffer) return;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer); CHKGL;
+	gl_state.element_buffer = buffer;
+}
+
+static inline void bind_texture(GLuint texture)
+{
+	if (gl_state.texture == texture) return;
+	glBindTexture(GL_TEXTURE_2D, texture); CHKGL;
+	gl_state.texture = texture;
+}
+
+static int has_extension(const char* name)
+{
+	GLint n = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+	for (int i = 0; i < n; i++) {
+		if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) return 1;
+	}
+	return 0;
+}
+
 static GLuint create_shader(const char* src, GLenum type)
 {
 	GLuint shader = glCreateShader(type); CHKGL;
@@ -106,66 +246,338 @@ static GLuint create_program(const char* vert_src, const char* frag_src)
 	return prg;
 }
 
+static inline size_t ring_vertex_offset()
+{
+	return draw_res.section * VERTEX_SECTION_SIZE + (size_t)draw_res.section_vertices * draw_res.vertex_size;
+}
+
+static inline int ring_element_index()
+{
+	return draw_res.section * MAX_ELEMENTS + draw_res.section_elements;
+}
+
+// next batch is written at the ring's current position
+static void set_batch_pointers()
+{
+	if (!draw_res.persistent) return;
+	draw_res.vertices = draw_res.vertex_map + ring_vertex_offset();
+	if (!draw_res.instanced) draw_res.elements = draw_res.element_map + ring_element_index();
+}
+
+static void set_vertex_pointers(size_t base)
+{
+	#define OFZ(e) (GLvoid*)(base + (size_t)&(((struct draw_vertex*)0)->e))
+	glVertexAttribPointer(draw_res.a_position, 2, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(position)); CHKGL;
+	glVertexAttribPointer(draw_res.a_uv, 2, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(uv)); CHKGL;
+	glVertexAttribPointer(draw_res.a_color, 4, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(color)); CHKGL;
+	#undef OFZ
+}
+
+static void set_quad_pointers(size_t base)
+{
+	#define OFZ(e) (GLvoid*)(base + (size_t)&(((struct draw_quad*)0)->e))
+	glVertexAttribPointer(draw_res.a_rect, 4, GL_SHORT, GL_FALSE, sizeof(struct draw_quad), OFZ(x)); CHKGL;
+	glVertexAttribPointer(draw_res.a_uv_rect, 4, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(struct draw_quad), OFZ(u0)); CHKGL;
+	glVertexAttribPointer(draw_res.a_color0, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct draw_quad), OFZ(color0)); CHKGL;
+	glVertexAttribPointer(draw_res.a_color1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct draw_quad), OFZ(color1)); CHKGL;
+	#undef OFZ
+}
+
+static void upload_unsynchronized(GLenum target, size_t offset, size_t sz, void* data)
+{
+	void* p = glMapBufferRange(target, offset, sz, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT); CHKGL;
+	AN(p);
+	memcpy(p, data, sz);
+	AN(glUnmapBuffer(target));
+}
+
+static void wait_fence(GLsync* fence)
+{
+	if (*fence == 0) return;
+	while (glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(*fence);
+	*fence = 0;
+}
+
+static void next_section()
+{
+	draw_res.section_vertices = 0;
+	draw_res.section_elements = 0;
+	if (draw_res.persistent) {
+		draw_res.fences[draw_res.section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); CHKGL;
+		draw_res.section = (draw_res.section + 1) % RING_SECTIONS;
+		wait_fence(&draw_res.fences[draw_res.section]);
+		set_batch_pointers();
+	} else {
+		draw_res.section++;
+		if (draw_res.section == RING_SECTIONS) {
+			// orphan; the driver hands us fresh storage
+			draw_res.section = 0;
+			bind_array_buffer(draw_res.vertex_buffer);
+			glBufferData(GL_ARRAY_BUFFER, RING_SECTIONS * VERTEX_SECTION_SIZE, NULL, GL_STREAM_DRAW); CHKGL;
+			if (!draw_res.instanced) {
+				bind_element_buffer(draw_res.element_buffer);
+				glBufferData(GL_ELEMENT_ARRAY_BUFFER, RING_SECTIONS * MAX_ELEMENTS * sizeof(ElementType), NULL, GL_STREAM_DRAW); CHKGL;
+			}
+		}
+	}
+}
+
 static void draw_flush()
 {
-	if (!draw_res.n_vertices || !draw_res.n_elements || !draw_res.n_texture_batches) {
+	if (!draw_res.n_vertices || !draw_res.n_texture_batches) {
 		// nothing to do
 		return;
 	}
 
-	glBindBuffer(GL_ARRAY_BUFFER, draw_res.vertex_buffer);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, draw_res.n_vertices * sizeof(struct draw_vertex), draw_res.vertices);
+	size_t vertex_offset = ring_vertex_offset();
+	size_t element_offset = ring_element_index() * sizeof(ElementType);
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, draw_res.element_buffer);
-	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, draw_res.n_elements * sizeof(ElementType), draw_res.elements);
+	bind_array_buffer(draw_res.vertex_buffer);
+	if (!draw_res.persistent) {
+		upload_unsynchronized(GL_ARRAY_BUFFER, vertex_offset, draw_res.n_vertices * draw_res.vertex_size, draw_res.vertices);
+		if (draw_res.n_elements) {
+			bind_element_buffer(draw_res.element_buffer);
+			upload_unsynchronized(GL_ELEMENT_ARRAY_BUFFER, element_offset, draw_res.n_elements * sizeof(ElementType), draw_res.elements);
+		}
+	}
 
-	ElementType* offset = 0;
-	for (int i = 0; i < draw_res.n_texture_batches; i++) {
-		struct texture_batch* batch = &draw_res.texture_batches[i];
-		glBindTexture(GL_TEXTURE_2D, batch->texture);
-		glDrawElements(GL_TRIANGLES, batch->n_elements, ELEMENT_SIZE_GL, offset);
-		offset += batch->n_elements;
+	if (draw_res.instanced) {
+		// no base instance before GL 4.2; the attributes are pointed at each batch instead
+		size_t offset = vertex_offset;
+		for (int i = 0; i < draw_res.n_texture_batches; i++) {
+			struct texture_batch* batch = &draw_res.texture_batches[i];
+			bind_texture(batch->texture);
+			set_quad_pointers(offset);
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, batch->n);
+			offset += batch->n * sizeof(struct draw_quad);
+		}
+	} else {
+		/* quad batches are drawn with the static quad elements, from the
+		 * batch's first vertex. other batches' elements are relative to
+		 * the flush's first vertex */
+		size_t first_vertex = 0;
+		ElementType* offset = (ElementType*)element_offset;
+		for (int i = 0; i < draw_res.n_texture_batches; i++) {
+			struct texture_batch* batch = &draw_res.texture_batches[i];
+			bind_texture(batch->texture);
+			if (batch->quads) {
+				set_vertex_pointers(vertex_offset + first_vertex * sizeof(struct draw_vertex));
+				bind_element_buffer(draw_res.quad_element_buffer);
+				glDrawElements(GL_TRIANGLES, batch->n * 6, ELEMENT_SIZE_GL, NULL);
+			} else {
+				set_vertex_pointers(vertex_offset);
+				bind_element_buffer(draw_res.element_buffer);
+				glDrawElements(GL_TRIANGLES, batch->n, ELEMENT_SIZE_GL, offset);
+				offset += batch->n;
+			}
+			first_vertex += batch->n_vertices;
+		}
 	}
 
+	draw_res.section_vertices += draw_res.n_vertices;
+	draw_res.section_elements += draw_res.n_elements;
 	draw_res.n_vertices = 0;
 	draw_res.n_elements = 0;
 	draw_res.n_texture_batches = 0;
+	set_batch_pointers();
 }
 
-static void draw_append(struct d_texture* texture, int n_vertices, int n_elements, struct draw_vertex* vertices, ElementType* elements)
+/* makes room for n_vertices and n_elements more in the current batch,
+ * flushing or moving on to the next ring section as needed, and adds
+ * n_quads quads (or n_elements elements if there are none) to the
+ * texture's batch */
+static void draw_reserve(struct d_texture* texture, int n_vertices, int n_elements, int n_quads)
 {
+	int quads = n_quads > 0;
 	texture->draw_tag = draw_scope.tag;
 	GLuint tid = texture->texture;
 
 	int flush = 0;
-	flush |= draw_res.n_vertices + n_vertices > MAX_VERTICES;
-	flush |= draw_res.n_elements + n_elements > MAX_ELEMENTS;
+	flush |= draw_res.section_vertices + draw_res.n_vertices + n_vertices > draw_res.max_vertices;
+	flush |= draw_res.section_elements + draw_res.n_elements + n_elements > MAX_ELEMENTS;
 	flush |= draw_res.n_texture_batches + 1 > MAX_TEXTURE_BINDS && draw_res.texture_batches[draw_res.n_texture_batches - 1].texture != tid;
 	if (flush) {
 		draw_flush();
-		ASSERT((draw_res.n_vertices + n_vertices) <= MAX_VERTICES);
-		ASSERT((draw_res.n_elements + n_elements) <= MAX_ELEMENTS);
+		if (draw_res.section_vertices + n_vertices > draw_res.max_vertices || draw_res.section_elements + n_elements > MAX_ELEMENTS) {
+			next_section();
+		}
+		ASSERT((draw_res.section_vertices + n_vertices) <= draw_res.max_vertices);
+		ASSERT((draw_res.section_elements + n_elements) <= MAX_ELEMENTS);
 		AZ(draw_res.n_texture_batches);
 	}
 
-	if (draw_res.n_texture_batches == 0 || draw_res.texture_batches[draw_res.n_texture_batches - 1].texture != tid) {
+	struct texture_batch* last = draw_res.n_texture_batches ? &draw_res.texture_batches[draw_res.n_texture_batches - 1] : NULL;
+	if (last == NULL || last->texture != tid || last->quads != quads) {
 		struct texture_batch batch = {
-			.n_elements = 0,
+			.quads = quads,
+			.n = 0,
+			.n_vertices = 0,
 			.texture = tid
 		};
 		memcpy(draw_res.texture_batches + draw_res.n_texture_batches, &batch, sizeof(batch));
-		draw_res.n_texture_batches++;
+		last = &draw_res.texture_batches[draw_res.n_texture_batches++];
 	}
+	last->n += quads ? n_quads : n_elements;
+	last->n_vertices += n_vertices;
+}
+
+/* general indexed geometry, for anything that isn't a quad (use
+ * draw_quad() for those); vertex path only */
+static inline void draw_append(struct d_texture* texture, int n_vertices, int n_elements, struct draw_vertex* vertices, ElementType* elements)
+{
+	ASSERT(!draw_res.instanced);
+	draw_reserve(texture, n_vertices, n_elements, 0);
 
-	memcpy(draw_res.vertices + draw_res.n_vertices, vertices, n_vertices * sizeof(struct draw_vertex));
+	memcpy((struct draw_vertex*)draw_res.vertices + draw_res.n_vertices, vertices, n_vertices * sizeof(struct draw_vertex));
 
+	// write only; the ring may be uncached memory
 	ElementType* ebase = draw_res.elements + draw_res.n_elements;
-	memcpy(ebase, elements, n_elements * sizeof(ElementType));
-	for (int i = 0; i < n_elements; i++) ebase[i] += draw_res.n_vertices;
+	for (int i = 0; i < n_elements; i++) ebase[i] = elements[i] + draw_res.n_vertices;
 
 	draw_res.n_vertices += n_vertices;
 	draw_res.n_elements += n_elements;
-	draw_res.texture_batches[draw_res.n_texture_batches - 1].n_elements += n_elements;
+}
+
+static inline GLshort to_short(float x)
+{
+	if (x < -32768.0f) return -32768;
+	if (x > 32767.0f) return 32767;
+	return lrintf(x);
+}
+
+// difference of two to_short()s, which may not fit a GLshort
+static inline GLshort to_extent(int x)
+{
+	if (x < 0) return 0;
+	if (x > 32767) return 32767;
+	return x;
+}
+
+static inline GLushort to_unorm16(float x)
+{
+	if (x < 0.0f) return 0;
+	if (x > 1.0f) return 65535;
+	return x * 65535.0f + 0.5f;
+}
+
+static void pack_color(uint8_t* dst, union vec4 color)
+{
+	for (int i = 0; i < 4; i++) {
+		float c = color.s[i];
+		dst[i] = c <= 0.0f ? 0 : c >= 1.0f ? 255 : (uint8_t)(c * 255.0f + 0.5f);
+	}
+}
+
+// quad from (x0,y0) to (x1,y1), shaded from c->color0 (top) to c->color1
+static void draw_quad(struct d_texture* texture, float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1, const struct quad_colors* c)
+{
+	if (!draw_res.instanced) {
+		draw_reserve(texture, 4, 0, 1);
+		struct draw_vertex vs[4] = {
+			{ .position = { .x = x0, .y = y0 }, .uv = { .u = u0, .v = v0 }, .color = c->color0 },
+			{ .position = { .x = x1, .y = y0 }, .uv = { .u = u1, .v = v0 }, .color = c->color0 },
+			{ .position = { .x = x1, .y = y1 }, .uv = { .u = u1, .v = v1 }, .color = c->color1 },
+			{ .position = { .x = x0, .y = y1 }, .uv = { .u = u0, .v = v1 }, .color = c->color1 }
+		};
+		memcpy((struct draw_vertex*)draw_res.vertices + draw_res.n_vertices, vs, sizeof(vs));
+		draw_res.n_vertices += 4;
+		return;
+	}
+
+	draw_reserve(texture, 1, 0, 1);
+	// edges are rounded separately so adjacent quads still meet
+	GLshort ix0 = to_short(x0);
+	GLshort iy0 = to_short(y0);
+	struct draw_quad q = {
+		.x = ix0,
+		.y = iy0,
+		.w = to_extent(to_short(x1) - ix0),
+		.h = to_extent(to_short(y1) - iy0),
+		.u0 = to_unorm16(u0),
+		.v0 = to_unorm16(v0),
+		.u1 = to_unorm16(u1),
+		.v1 = to_unorm16(v1),
+	};
+	memcpy(q.color0, c->packed0, 4);
+	memcpy(q.color1, c->packed1, 4);
+	// one write of the whole quad; the ring may be uncached memory
+	memcpy((struct draw_quad*)draw_res.vertices + draw_res.n_vertices, &q, sizeof(q));
+	draw_res.n_vertices++;
+}
+
+// draws the layer's quads, grouped by texture
+static void layer_draw()
+{
+	if (layer.n == 0) return;
+
+	// counting sort by slot; slots are numbered in order of first use
+	int counts[LAYER_MAX_TEXTURES];
+	memset(counts, 0, layer.n_textures * sizeof(*counts));
+	for (int i = 0; i < layer.n; i++) counts[layer.quads[i].slot]++;
+	int offset = 0;
+	for (int i = 0; i < layer.n_textures; i++) {
+		layer.offsets[i] = offset;
+		offset += counts[i];
+	}
+	for (int i = 0; i < layer.n; i++) {
+		struct layer_quad* q = &layer.quads[i];
+		layer.sorted[layer.offsets[q->slot]++] = *q;
+	}
+
+	for (int i = 0; i < layer.n; i++) {
+		struct layer_quad* q = &layer.sorted[i];
+		draw_quad(q->texture, q->x0, q->y0, q->x1, q->y1, q->u0, q->v0, q->u1, q->v1, &q->colors);
+	}
+
+	layer.n = 0;
+	layer.n_textures = 0;
+	layer.last_slot = 0;
+}
+
+static int layer_slot(struct d_texture* texture)
+{
+	if (layer.n_textures > 0 && layer.textures[layer.last_slot] == texture) return layer.last_slot;
+	for (int i = 0; i < layer.n_textures; i++) {
+		if (layer.textures[i] == texture) return layer.last_slot = i;
+	}
+	if (layer.n_textures == LAYER_MAX_TEXTURES) layer_draw();
+	layer.textures[layer.n_textures] = texture;
+	return layer.last_slot = layer.n_textures++;
+}
+
+static void layer_record(struct d_texture* texture, float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1)
+{
+	if (layer.n == layer.cap) {
+		// only grows while warming up; the buffers are kept
+		layer.cap = layer.cap ? layer.cap * 2 : 1024;
+		layer.quads = mem_realloc(layer.quads, layer.cap * sizeof(*layer.quads));
+		layer.sorted = mem_realloc(layer.sorted, layer.cap * sizeof(*layer.sorted));
+	}
+
+	// so texture_pre_modify() knows to draw the layer first
+	texture->draw_tag = draw_scope.tag;
+
+	int slot = layer_slot(texture); // may draw the layer so far
+	struct layer_quad* q = &layer.quads[layer.n++];
+	q->texture = texture;
+	q->slot = slot;
+	q->x0 = x0; q->y0 = y0; q->x1 = x1; q->y1 = y1;
+	q->u0 = u0; q->v0 = v0; q->u1 = u1; q->v1 = v1;
+	q->colors = draw_scope.colors;
+}
+
+static void put_quad(struct d_texture* texture, float x0, float y0, float x1, float y1, float u0, float v0, float u1, float v1)
+{
+	// cull what the scissor would clip away anyway
+	struct d_box* c = &draw_scope.clip;
+	if (x1 <= c->x0 || x0 >= c->x1 || y1 <= c->y0 || y0 >= c->y1) return;
+
+	if (layer.open) {
+		layer_record(texture, x0, y0, x1, y1, u0, v0, u1, v1);
+	} else {
+		draw_quad(texture, x0, y0, x1, y1, u0, v0, u1, v1, &draw_scope.colors);
+	}
 }
 
 static void texture_pre_modify(struct d_texture* t)
@@ -173,6 +585,7 @@ static void texture_pre_modify(struct d_texture* t)
 	if (t->draw_tag == draw_scope.tag) {
 		/* texture is being used in current draw scope, so flush
 		 * pending draw commands before altering the texture */
+		layer_draw();
 		draw_flush();
 		t->draw_tag = 0;
 	}
@@ -191,6 +604,8 @@ void d_init()
 	}
 
 	{
+		draw_res.instanced = gl3wIsSupported(3, 3);
+
 		const GLchar* vert_src =
 			"#version 130\n"
 
@@ -211,6 +626,30 @@ void d_init()
 			"}\n"
 			;
 
+		// corners of a triangle strip: (0,0), (1,0), (0,1), (1,1)
+		const GLchar* quad_vert_src =
+			"#version 130\n"
+
+			"uniform vec2 u_scaling;\n"
+
+			"attribute vec4 a_rect;\n"
+			"attribute vec4 a_uv_rect;\n"
+			"attribute vec4 a_color0;\n"
+			"attribute vec4 a_color1;\n"
+
+			"varying vec2 v_uv;\n"
+			"varying vec4 v_color;\n"
+
+			"void main()\n"
+			"{\n"
+			"	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+			"	v_uv = mix(a_uv_rect.xy, a_uv_rect.zw, corner);\n"
+			"	v_color = mix(a_color0, a_color1, corner.y);\n"
+			"	vec2 position = a_rect.xy + corner * a_rect.zw;\n"
+			"	gl_Position = vec4(position * u_scaling * vec2(2,2) + vec2(-1,1), 0, 1);\n"
+			"}\n"
+			;
+
 		const GLchar* frag_src =
 			"#version 130\n"
 
@@ -225,50 +664,85 @@ void d_init()
 			"}\n"
 			;
 
-		GLuint prg = draw_res.prg = create_program(vert_src, frag_src);
+		GLuint prg = draw_res.prg = create_program(draw_res.instanced ? quad_vert_src : vert_src, frag_src);
 
 		draw_res.u_texture = glGetUniformLocation(prg, "u_texture"); CHKGL;
 		draw_res.u_scaling = glGetUniformLocation(prg, "u_scaling"); CHKGL;
 
-		GLuint a_position = glGetAttribLocation(prg, "a_position"); CHKGL;
-		GLuint a_uv = glGetAttribLocation(prg, "a_uv"); CHKGL;
-		GLuint a_color = glGetAttribLocation(prg, "a_color"); CHKGL;
-
-		size_t vertices_sz = MAX_VERTICES * sizeof(struct draw_vertex);
-		AN(draw_res.vertices = malloc(vertices_sz));
+		if (draw_res.instanced) {
+			draw_res.a_rect = glGetAttribLocation(prg, "a_rect"); CHKGL;
+			draw_res.a_uv_rect = glGetAttribLocation(prg, "a_uv_rect"); CHKGL;
+			draw_res.a_color0 = glGetAttribLocation(prg, "a_color0"); CHKGL;
+			draw_res.a_color1 = glGetAttribLocation(prg, "a_color1"); CHKGL;
+			draw_res.vertex_size = sizeof(struct draw_quad);
+			draw_res.max_vertices = MAX_QUADS;
+		} else {
+			draw_res.a_position = glGetAttribLocation(prg, "a_position"); CHKGL;
+			draw_res.a_uv = glGetAttribLocation(prg, "a_uv"); CHKGL;
+			draw_res.a_color = glGetAttribLocation(prg, "a_color"); CHKGL;
+			draw_res.vertex_size = sizeof(struct draw_vertex);
+			draw_res.max_vertices = MAX_VERTICES;
+		}
+
+		draw_res.persistent = gl3wIsSupported(4, 4) || has_extension("GL_ARB_buffer_storage");
+		GLbitfield storage_flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		size_t vertices_sz = RING_SECTIONS * VERTEX_SECTION_SIZE;
 		glGenBuffers(1, &draw_res.vertex_buffer); CHKGL;
 		glGenVertexArrays(1, &draw_res.vertex_array); CHKGL;
-		glBindVertexArray(draw_res.vertex_array); CHKGL;
-		glBindBuffer(GL_ARRAY_BUFFER, draw_res.vertex_buffer); CHKGL;
-		glBufferData(GL_ARRAY_BUFFER, vertices_sz, NULL, GL_STREAM_DRAW); CHKGL;
-		glEnableVertexAttribArray(a_position); CHKGL;
-		glEnableVertexAttribArray(a_uv); CHKGL;
-		glEnableVertexAttribArray(a_color); CHKGL;
-
-		#define OFZ(e) (GLvoid*)((size_t)&(((struct draw_vertex*)0)->e))
-		glVertexAttribPointer(a_position, 2, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(position)); CHKGL;
-		glVertexAttribPointer(a_uv, 2, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(uv)); CHKGL;
-		glVertexAttribPointer(a_color, 4, GL_FLOAT, GL_FALSE, sizeof(struct draw_vertex), OFZ(color)); CHKGL;
-		#undef OFZ
-
-		size_t elements_sz = MAX_ELEMENTS * sizeof(ElementType);
-		AN(draw_res.elements = malloc(elements_sz));
-		glGenBuffers(1, &draw_res.element_buffer); CHKGL;
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, draw_res.element_buffer); CHKGL;
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements_sz, NULL, GL_STREAM_DRAW); CHKGL;
+		bind_vertex_array(draw_res.vertex_array);
+		bind_array_buffer(draw_res.vertex_buffer);
+		if (draw_res.persistent) {
+			glBufferStorage(GL_ARRAY_BUFFER, vertices_sz, NULL, storage_flags); CHKGL;
+			AN(draw_res.vertex_map = glMapBufferRange(GL_ARRAY_BUFFER, 0, vertices_sz, storage_flags)); CHKGL;
+		} else {
+			glBufferData(GL_ARRAY_BUFFER, vertices_sz, NULL, GL_STREAM_DRAW); CHKGL;
+			AN(draw_res.vertices = malloc(VERTEX_SECTION_SIZE));
+		}
+		if (draw_res.instanced) {
+			GLuint as[] = { draw_res.a_rect, draw_res.a_uv_rect, draw_res.a_color0, draw_res.a_color1 };
+			for (int i = 0; i < 4; i++) {
+				glEnableVertexAttribArray(as[i]); CHKGL;
+				glVertexAttribDivisor(as[i], 1); CHKGL;
+			}
+			set_quad_pointers(0);
+		} else {
+			glEnableVertexAttribArray(draw_res.a_position); CHKGL;
+			glEnableVertexAttribArray(draw_res.a_uv); CHKGL;
+			glEnableVertexAttribArray(draw_res.a_color); CHKGL;
+			set_vertex_pointers(0);
+
+			// quad i is vertices 4i to 4i+3, from top left and clockwise
+			ElementType* quad_elements = malloc(MAX_QUAD_ELEMENTS * sizeof(ElementType));
+			AN(quad_elements);
+			for (int i = 0; i < MAX_VERTICES / 4; i++) {
+				ElementType v = i * 4;
+				ElementType* e = quad_elements + i * 6;
+				e[0] = v; e[1] = v + 1; e[2] = v + 2;
+				e[3] = v; e[4] = v + 2; e[5] = v + 3;
+			}
+			glGenBuffers(1, &draw_res.quad_element_buffer); CHKGL;
+			bind_element_buffer(draw_res.quad_element_buffer);
+			glBufferData(GL_ELEMENT_ARRAY_BUFFER, MAX_QUAD_ELEMENTS * sizeof(ElementType), quad_elements, GL_STATIC_DRAW); CHKGL;
+			free(quad_elements);
+
+			size_t elements_sz = RING_SECTIONS * MAX_ELEMENTS * sizeof(ElementType);
+			glGenBuffers(1, &draw_res.element_buffer); CHKGL;
+			bind_element_buffer(draw_res.element_buffer);
+			if (draw_res.persistent) {
+				glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, elements_sz, NULL, storage_flags); CHKGL;
+				AN(draw_res.element_map = glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, elements_sz, storage_flags)); CHKGL;
+			} else {
+				glBufferData(GL_ELEMENT_ARRAY_BUFFER, elements_sz, NULL, GL_STREAM_DRAW); CHKGL;
+				AN(draw_res.elements = malloc(MAX_ELEMENTS * sizeof(ElementType)));
+			}
+		}
+		set_batch_pointers();
 
 		AN(draw_res.texture_batches = malloc(MAX_TEXTURE_BINDS * sizeof(struct texture_batch)));
 	}
-}
 
-void d_inc_frame_tag()
-{
-	frame_tag++;
-}
-
-uint64_t d_get_frame_tag()
-{
-	return frame_tag;
+	d_frame_init();
 }
 
 void d_texture_init(struct d_texture* t, int width, int height)
@@ -277,7 +751,7 @@ void d_texture_init(struct d_texture* t, int width, int height)
 
 	int level = 0;
 	int border = 0;
-	glBindTexture(GL_TEXTURE_2D, t->texture);
+	bind_texture(t->texture);
 	glTexImage2D(
 		GL_TEXTURE_2D,
 		level,
@@ -301,6 +775,7 @@ void d_texture_init(struct d_texture* t, int width, int height)
 
 void d_texture_free(struct d_texture* t)
 {
+	if (gl_state.texture == t->texture) gl_state.texture = GL_NONE_BOUND;
 	glDeleteTextures(1, &t->texture);
 	memset(t, 0, sizeof(*t));
 }
@@ -320,7 +795,7 @@ void d_texture_sub_image(struct d_texture* t, int x, int y, int w, int h, void*
 	texture_pre_modify(t);
 
 	int level = 0;
-	glBindTexture(GL_TEXTURE_2D, t->texture);
+	bind_texture(t->texture);
 
 	glTexSubImage2D(
 		GL_TEXTURE_2D,
@@ -349,56 +824,43 @@ void d_texture_sub_image_intensity(struct d_texture* t, int x, int y, int w, int
 
 void d_rect(float x, float y, float width, float height)
 {
-	float x0 = x;
-	float y0 = y;
-	float x1 = x + width;
-	float y1 = y + height;
 	float u,v;
 	d_main_atlas_get_dot_uv(&u, &v);
-	struct draw_vertex vs[4] = {
-		{ .position = { .x = x0, .y = y0 }, .uv = { .u = u, .v = v }, .color = draw_scope.color0 },
-		{ .position = { .x = x1, .y = y0 }, .uv = { .u = u, .v = v }, .color = draw_scope.color0 },
-		{ .position = { .x = x1, .y = y1 }, .uv = { .u = u, .v = v }, .color = draw_scope.color1 },
-		{ .position = { .x = x0, .y = y1 }, .uv = { .u = u, .v = v }, .color = draw_scope.color1 }
-	};
-	ElementType es[6] = {0,1,2,0,2,3};
-	draw_append(d_main_atlas_get_texture(), 4, 6, vs, es);
+	put_quad(d_main_atlas_get_texture(), x, y, x + width, y + height, u, v, u, v);
 }
 
 void d_blit(struct d_texture* t, int sx, int sy, int sw, int sh, float dx, float dy)
 {
-	float dx0 = dx;
-	float dy0 = dy;
-	float dx1 = dx + sw;
-	float dy1 = dy + sh;
-
 	float u0,v0,u1,v1;
 	d_texture_get_uv(t, sx, sy, &u0, &v0);
 	d_texture_get_uv(t, sx + sw, sy + sh, &u1, &v1);
-
-	struct draw_vertex vs[4] = {
-		{ .position = { .x = dx0, .y = dy0 }, .uv = { .u = u0, .v = v0 }, .color = draw_scope.color0 },
-		{ .position = { .x = dx1, .y = dy0 }, .uv = { .u = u1, .v = v0 }, .color = draw_scope.color0 },
-		{ .position = { .x = dx1, .y = dy1 }, .uv = { .u = u1, .v = v1 }, .color = draw_scope.color1 },
-		{ .position = { .x = dx0, .y = dy1 }, .uv = { .u = u0, .v = v1 }, .color = draw_scope.color1 }
-	};
-	ElementType es[6] = {0,1,2,0,2,3};
-	draw_append(t, 4, 6, vs, es);
+	put_quad(t, dx, dy, dx + sw, dy + sh, u0, v0, u1, v1);
 }
 
-void d_begin(int win_id)
+int d_begin(int win_id)
 {
 	AZ(draw_scope.begun);
-	draw_scope.begun = 1;
-	draw_scope.tag++;
 
 	win_make_current(win_id);
 
+	int width, height;
+	win_get_size(win_id, &width, &height);
+	if (!d_damage_begin(width, height, win_get_buffer_age(win_id))) return 0;
+
+	draw_scope.begun = 1;
+	draw_scope.tag++;
 	draw_scope.win_id = win_id;
-	win_get_size(win_id, &draw_scope.win_width, &draw_scope.win_height);
+	draw_scope.win_width = width;
+	draw_scope.win_height = height;
 
 	glViewport(0, 0, draw_scope.win_width, draw_scope.win_height); CHKGL;
 
+	// only the damaged area is cleared and drawn
+	struct d_box* c = &draw_scope.clip;
+	d_get_damage(NULL, c);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(c->x0, height - c->y1, c->x1 - c->x0, c->y1 - c->y0); CHKGL;
+
 	// premultiplied alpha
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); CHKGL;
@@ -407,27 +869,70 @@ void d_begin(int win_id)
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glUseProgram(draw_res.prg);
+	// someone else may have changed GL state since last frame
+	gl_state_invalidate();
+	use_program(draw_res.prg);
 	glUniform1i(draw_res.u_texture, 0);
 	glUniform2f(draw_res.u_scaling, 1.0f / (float)draw_scope.win_width, -1.0f / (float)draw_scope.win_height);
 
-	glBindVertexArray(draw_res.vertex_array);
+	bind_vertex_array(draw_res.vertex_array);
+
+	d_frame_allocs_begin();
+	return 1;
 }
 
 void d_end()
 {
 	AN(draw_scope.begun);
 	draw_scope.begun = 0;
+	if (layer.open) d_layer_end();
 	draw_flush();
+	glDisable(GL_SCISSOR_TEST);
+	d_damage_end();
+	d_frame_allocs_end();
+}
+
+void d_flip(int win_id)
+{
+	int n;
+	const struct d_box* boxes = d_get_damage(&n, NULL);
+	struct win_rect rects[D_MAX_FRAME_DAMAGE];
+	ASSERT(n <= D_MAX_FRAME_DAMAGE);
+	for (int i = 0; i < n; i++) {
+		rects[i] = (struct win_rect) {
+			.x = boxes[i].x0,
+			.y = boxes[i].y0,
+			.width = boxes[i].x1 - boxes[i].x0,
+			.height = boxes[i].y1 - boxes[i].y0
+		};
+	}
+	win_flip_damage(win_id, rects, n);
 }
 
 void d_set_color(union vec4 color)
 {
-	draw_scope.color0 = draw_scope.color1 = color;
+	d_set_vertical_shade(color, color);
 }
 
 void d_set_vertical_shade(union vec4 color0, union vec4 color1)
 {
-	draw_scope.color0 = color0;
-	draw_scope.color1 = color1;
+	struct quad_colors* c = &draw_scope.colors;
+	c->color0 = color0;
+	c->color1 = color1;
+	pack_color(c->packed0, color0);
+	pack_color(c->packed1, color1);
+}
+
+void d_layer_begin()
+{
+	AN(draw_scope.begun);
+	AZ(layer.open);
+	layer.open = 1;
+}
+
+void d_layer_end()
+{
+	AN(layer.open);
+	layer_draw();
+	layer.open = 0;
 }
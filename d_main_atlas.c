@@ -1,5 +1,6 @@
 #include "a.h"
 #include "d.h"
+#include "mem.h"
 #include "scratch.h"
 
 #define STBRP_ASSERT ASSERT
@@ -52,7 +53,7 @@ void d_main_atlas_reset()
 	int n_nodes = width;
 
 	if (!initialized) {
-		AN(rp_nodes = calloc(n_nodes, sizeof(stbrp_node)));
+		rp_nodes = mem_calloc(n_nodes * sizeof(stbrp_node));
 		initialized = 1;
 		d_texture_init(&texture, width, height);
 	}
@@ -0,0 +1,858 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "unittest.h"
+#include "benchmark.h"
+
+#include "a.h"
+#include "d.h"
+
+/* software backend; draws into an RGBA framebuffer in memory. all quads are
+ * axis aligned and unscaled, so d_rect() is a span fill and d_blit() a span
+ * copy, both blended as premultiplied alpha like the GL backend does
+ * (dst = src + dst * (1 - src.a)). pixels are covered if their centers are,
+ * and textures are sampled nearest, so blits at fractional positions snap
+ * to whole pixels where GL would filter. results are exact and identical
+ * with and without SSE2, so they can be compared pixel for pixel */
+
+static struct {
+	int width, height;
+	uint8_t* pixels;
+} fb;
+
+static struct {
+	int begun;
+	union vec4 color0, color1;
+	struct d_box clip; // bounds of the frame's damage
+} draw_scope;
+
+// x*y/255, rounded; exact for 8 bit x and y
+static inline uint32_t mul255(uint32_t x, uint32_t y)
+{
+	uint32_t t = x * y + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline uint8_t add_sat(uint32_t x, uint32_t y)
+{
+	uint32_t s = x + y;
+	return s > 255 ? 255 : s;
+}
+
+static void span_fill_scalar(uint8_t* restrict dst, int n, const uint8_t* color)
+{
+	uint32_t ia = 255 - color[3];
+	for (int i = 0; i < n; i++) {
+		uint8_t* d = dst + i * 4;
+		for (int j = 0; j < 4; j++) d[j] = add_sat(color[j], mul255(d[j], ia));
+	}
+}
+
+static void span_blit_scalar(uint8_t* restrict dst, const uint8_t* restrict src, int n, const uint8_t* color)
+{
+	for (int i = 0; i < n; i++) {
+		uint8_t* d = dst + i * 4;
+		const uint8_t* s = src + i * 4;
+		uint32_t sa = mul255(s[3], color[3]);
+		uint32_t ia = 255 - sa;
+		for (int j = 0; j < 3; j++) d[j] = add_sat(mul255(s[j], color[j]), mul255(d[j], ia));
+		d[3] = add_sat(sa, mul255(d[3], ia));
+	}
+}
+
+#ifdef __SSE2__
+
+/* 2 pixels per 128 bits, 16 bits per channel; mul255() fits, as
+ * 255*255+128+255 < 65536 */
+static inline __m128i mul255_epi16(__m128i x, __m128i y)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i alpha_epi16(__m128i x)
+{
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3,3,3,3));
+	return _mm_shufflehi_epi16(x, _MM_SHUFFLE(3,3,3,3));
+}
+
+static inline __m128i color_epi16(const uint8_t* color)
+{
+	return _mm_setr_epi16(color[0], color[1], color[2], color[3], color[0], color[1], color[2], color[3]);
+}
+
+// s + d * (255 - s.a), for 2 pixels of each
+static inline __m128i over_epi16(__m128i s, __m128i d)
+{
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(255), alpha_epi16(s));
+	return _mm_add_epi16(s, mul255_epi16(d, ia));
+}
+
+static void span_fill(uint8_t* restrict dst, int n, const uint8_t* color)
+{
+	if (color[3] == 255) {
+		uint32_t c;
+		memcpy(&c, color, 4);
+		uint32_t* d = (uint32_t*)dst;
+		for (int i = 0; i < n; i++) d[i] = c;
+		return;
+	}
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = color_epi16(color);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i* p = (__m128i*)(dst + i * 4);
+		__m128i d = _mm_loadu_si128(p);
+		__m128i lo = over_epi16(c, _mm_unpacklo_epi8(d, zero));
+		__m128i hi = over_epi16(c, _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+	}
+	if (i + 2 <= n) {
+		__m128i* p = (__m128i*)(dst + i * 4);
+		__m128i d = over_epi16(c, _mm_unpacklo_epi8(_mm_loadl_epi64(p), zero));
+		_mm_storel_epi64(p, _mm_packus_epi16(d, d));
+		i += 2;
+	}
+	span_fill_scalar(dst + i * 4, n - i, color);
+}
+
+static void span_blit(uint8_t* restrict dst, const uint8_t* restrict src, int n, const uint8_t* color)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = color_epi16(color);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i* p = (__m128i*)(dst + i * 4);
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		__m128i d = _mm_loadu_si128(p);
+		__m128i lo = over_epi16(mul255_epi16(_mm_unpacklo_epi8(s, zero), c), _mm_unpacklo_epi8(d, zero));
+		__m128i hi = over_epi16(mul255_epi16(_mm_unpackhi_epi8(s, zero), c), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+	}
+	// glyphs are narrow, so tails are common
+	if (i + 2 <= n) {
+		__m128i* p = (__m128i*)(dst + i * 4);
+		__m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i * 4)), zero);
+		__m128i d = over_epi16(mul255_epi16(s, c), _mm_unpacklo_epi8(_mm_loadl_epi64(p), zero));
+		_mm_storel_epi64(p, _mm_packus_epi16(d, d));
+		i += 2;
+	}
+	span_blit_scalar(dst + i * 4, src + i * 4, n - i, color);
+}
+
+#else
+
+#define span_fill span_fill_scalar
+#define span_blit span_blit_scalar
+
+#endif
+
+static inline uint8_t pack_channel(float c)
+{
+	return c <= 0.0f ? 0 : c >= 1.0f ? 255 : (uint8_t)(c * 255.0f + 0.5f);
+}
+
+// shade at pixel row py of a quad spanning y0 to y1, as RGBA8
+static void row_color(uint8_t* dst, int py, float y0, float y1)
+{
+	float t = y1 > y0 ? ((float)py + 0.5f - y0) / (y1 - y0) : 0.0f;
+	for (int i = 0; i < 4; i++) {
+		float c0 = draw_scope.color0.s[i];
+		float c1 = draw_scope.color1.s[i];
+		dst[i] = pack_channel(c0 + (c1 - c0) * t);
+	}
+}
+
+// first pixel whose center is at or past x
+static inline int pixel_edge(float x)
+{
+	if (x < -1e9f) return -1000000000;
+	if (x > 1e9f) return 1000000000;
+	return (int)ceilf(x - 0.5f);
+}
+
+static inline int clampi(int x, int min, int max)
+{
+	return x < min ? min : x > max ? max : x;
+}
+
+static inline int is_uniform()
+{
+	return memcmp(&draw_scope.color0, &draw_scope.color1, sizeof(union vec4)) == 0;
+}
+
+void d_init()
+{
+	d_frame_init();
+}
+
+void d_soft_set_size(int width, int height)
+{
+	AZ(draw_scope.begun);
+	ASSERT(width > 0 && height > 0);
+	free(fb.pixels);
+	AN(fb.pixels = malloc((size_t)width * height * 4));
+	fb.width = width;
+	fb.height = height;
+	d_damage_all();
+}
+
+uint8_t* d_soft_get_pixels(int* width, int* height)
+{
+	if (width != NULL) *width = fb.width;
+	if (height != NULL) *height = fb.height;
+	return fb.pixels;
+}
+
+void d_texture_init(struct d_texture* t, int width, int height)
+{
+	AN(t->pixels = calloc((size_t)width * height, 4));
+	t->width = width;
+	t->height = height;
+}
+
+void d_texture_free(struct d_texture* t)
+{
+	free(t->pixels);
+	memset(t, 0, sizeof(*t));
+}
+
+void d_texture_clear(struct d_texture* t)
+{
+	memset(t->pixels, 0, (size_t)t->width * t->height * 4);
+}
+
+void d_texture_sub_image(struct d_texture* t, int x, int y, int w, int h, void* data)
+{
+	ASSERT(x >= 0 && y >= 0 && x + w <= t->width && y + h <= t->height);
+	for (int row = 0; row < h; row++) {
+		uint8_t* dst = t->pixels + ((size_t)(y + row) * t->width + x) * 4;
+		memcpy(dst, (uint8_t*)data + (size_t)row * w * 4, w * 4);
+	}
+}
+
+void d_texture_sub_image_intensity(struct d_texture* t, int x, int y, int w, int h, void* restrict data)
+{
+	ASSERT(x >= 0 && y >= 0 && x + w <= t->width && y + h <= t->height);
+	const uint8_t* src = data;
+	for (int row = 0; row < h; row++) {
+		uint8_t* dst = t->pixels + ((size_t)(y + row) * t->width + x) * 4;
+		for (int i = 0; i < w; i++) {
+			uint8_t in = *(src++);
+			for (int j = 0; j < 4; j++) *(dst++) = in;
+		}
+	}
+}
+
+void d_rect(float x, float y, float width, float height)
+{
+	AN(draw_scope.begun);
+	struct d_box* c = &draw_scope.clip;
+	int x0 = clampi(pixel_edge(x), c->x0, c->x1);
+	int x1 = clampi(pixel_edge(x + width), c->x0, c->x1);
+	int y0 = clampi(pixel_edge(y), c->y0, c->y1);
+	int y1 = clampi(pixel_edge(y + height), c->y0, c->y1);
+	if (x0 >= x1) return;
+
+	int uniform = is_uniform();
+	uint8_t color[4];
+	if (uniform) row_color(color, 0, 0, 0);
+	for (int py = y0; py < y1; py++) {
+		if (!uniform) row_color(color, py, y, y + height);
+		span_fill(fb.pixels + ((size_t)py * fb.width + x0) * 4, x1 - x0, color);
+	}
+}
+
+void d_blit(struct d_texture* t, int sx, int sy, int sw, int sh, float dx, float dy)
+{
+	AN(draw_scope.begun);
+	int x0 = pixel_edge(dx);
+	int y0 = pixel_edge(dy);
+
+	// clip against the damage and the texture, in source coordinates
+	struct d_box* c = &draw_scope.clip;
+	int cx0 = sx + clampi(c->x0 - x0, 0, sw);
+	int cy0 = sy + clampi(c->y0 - y0, 0, sh);
+	int cx1 = sx + clampi(c->x1 - x0, 0, sw);
+	int cy1 = sy + clampi(c->y1 - y0, 0, sh);
+	cx0 = clampi(cx0, 0, t->width);
+	cy0 = clampi(cy0, 0, t->height);
+	cx1 = clampi(cx1, 0, t->width);
+	cy1 = clampi(cy1, 0, t->height);
+	if (cx0 >= cx1) return;
+
+	int uniform = is_uniform();
+	uint8_t color[4];
+	if (uniform) row_color(color, 0, 0, 0);
+	for (int ty = cy0; ty < cy1; ty++) {
+		int py = y0 + ty - sy;
+		if (!uniform) row_color(color, py, dy, dy + sh);
+		uint8_t* dst = fb.pixels + ((size_t)py * fb.width + x0 + cx0 - sx) * 4;
+		uint8_t* src = t->pixels + ((size_t)ty * t->width + cx0) * 4;
+		span_blit(dst, src, cx1 - cx0, color);
+	}
+}
+
+// the framebuffer is never swapped, so it always holds the last frame
+int d_begin(int win_id)
+{
+	AZ(draw_scope.begun);
+	AN(fb.pixels);
+	if (!d_damage_begin(fb.width, fb.height, 1)) return 0;
+	draw_scope.begun = 1;
+
+	// like glClear() with a transparent black clear color, within the damage
+	struct d_box* c = &draw_scope.clip;
+	d_get_damage(NULL, c);
+	for (int y = c->y0; y < c->y1; y++) {
+		memset(fb.pixels + ((size_t)y * fb.width + c->x0) * 4, 0, (c->x1 - c->x0) * 4);
+	}
+
+	d_frame_allocs_begin();
+	return 1;
+}
+
+void d_end()
+{
+	AN(draw_scope.begun);
+	draw_scope.begun = 0;
+	d_damage_end();
+	d_frame_allocs_end();
+}
+
+// the pixels are read with d_soft_get_pixels(); d_get_damage() says what changed
+void d_flip(int win_id)
+{
+}
+
+void d_set_color(union vec4 color)
+{
+	d_set_vertical_shade(color, color);
+}
+
+void d_set_vertical_shade(union vec4 color0, union vec4 color1)
+{
+	draw_scope.color0 = color0;
+	draw_scope.color1 = color1;
+}
+
+// quads are drawn right away and in order, which any layer allows
+void d_layer_begin()
+{
+}
+
+void d_layer_end()
+{
+}
+
+#ifdef UNITTEST
+
+#include "deckard.h"
+
+// opened by pre_test()
+static int font;
+
+/* the deckard scene is drawn for SCENE_WARMUP frames by pre_test(), then
+ * for SCENE_FRAMES frames that shouldn't allocate */
+#define SCENE_WARMUP (100)
+#define SCENE_FRAMES (500)
+
+static void draw_scene_frame(uint64_t anim_frame)
+{
+	d_inc_frame_tag();
+	d_damage_all();
+	AN(d_begin(0));
+	deckard_draw(font, anim_frame);
+	d_end();
+}
+
+static union vec4 rgba(float r, float g, float b, float a)
+{
+	return (union vec4) { .r = r, .g = g, .b = b, .a = a };
+}
+
+static uint8_t* pixel(int x, int y)
+{
+	return fb.pixels + ((size_t)y * fb.width + x) * 4;
+}
+
+static int pixel_is(int x, int y, int r, int g, int b, int a)
+{
+	uint8_t* p = pixel(x, y);
+	return p[0] == r && p[1] == g && p[2] == b && p[3] == a;
+}
+
+static void test_rect()
+{
+	AN(d_begin(0));
+	d_set_color(rgba(1, 0, 0, 1));
+	d_rect(2, 3, 4, 5);
+	for (int y = 0; y < fb.height; y++) {
+		for (int x = 0; x < fb.width; x++) {
+			int inside = x >= 2 && x < 6 && y >= 3 && y < 8;
+			ASSERT(inside ? pixel_is(x, y, 255, 0, 0, 255) : pixel_is(x, y, 0, 0, 0, 0));
+		}
+	}
+	d_end();
+}
+
+static void test_rect_covers_pixel_centers()
+{
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	// centers 1.5 and 2.5 are inside, 0.5 and 3.5 aren't
+	d_rect(1.4, 0, 1.6, 1);
+	ASSERT(pixel_is(0, 0, 0, 0, 0, 0));
+	ASSERT(pixel_is(1, 0, 255, 255, 255, 255));
+	ASSERT(pixel_is(2, 0, 255, 255, 255, 255));
+	ASSERT(pixel_is(3, 0, 0, 0, 0, 0));
+	// clipped at the edges
+	d_rect(-10, -10, 1000, 1000);
+	ASSERT(pixel_is(fb.width - 1, fb.height - 1, 255, 255, 255, 255));
+	d_end();
+}
+
+static void test_premultiplied_blend()
+{
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	d_rect(0, 0, 8, 1);
+	d_set_color(rgba(0.5, 0, 0, 0.5));
+	d_rect(0, 0, 8, 1);
+	// r = 128 + 255*127/255; g = b = 255*127/255
+	for (int x = 0; x < 8; x++) ASSERT(pixel_is(x, 0, 255, 127, 127, 255));
+	ASSERT(pixel_is(8, 0, 0, 0, 0, 0));
+	d_end();
+}
+
+static void test_vertical_shade()
+{
+	AN(d_begin(0));
+	d_set_vertical_shade(rgba(0, 0, 0, 1), rgba(1, 1, 1, 1));
+	d_rect(0, 0, 1, 2);
+	// shaded at row centers, t=0.25 and t=0.75
+	ASSERT(pixel_is(0, 0, 64, 64, 64, 255));
+	ASSERT(pixel_is(0, 1, 191, 191, 191, 255));
+	d_end();
+}
+
+static void test_blit()
+{
+	struct d_texture t;
+	d_texture_init(&t, 4, 4);
+	uint8_t data[4 * 4 * 4];
+	for (int i = 0; i < sizeof(data); i++) data[i] = (i & 3) == 3 ? 255 : i;
+	d_texture_sub_image(&t, 0, 0, 4, 4, data);
+
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	d_blit(&t, 1, 1, 2, 3, 5, 6);
+	for (int y = 0; y < 3; y++) {
+		for (int x = 0; x < 2; x++) {
+			ASSERT(memcmp(pixel(5 + x, 6 + y), data + ((1 + y) * 4 + 1 + x) * 4, 4) == 0);
+		}
+	}
+	ASSERT(pixel_is(4, 6, 0, 0, 0, 0));
+	ASSERT(pixel_is(7, 6, 0, 0, 0, 0));
+	ASSERT(pixel_is(5, 9, 0, 0, 0, 0));
+
+	// clipped by the framebuffer; texel (3,3) lands on (0,0)
+	d_blit(&t, 0, 0, 4, 4, -3, -3);
+	ASSERT(memcmp(pixel(0, 0), data + (3 * 4 + 3) * 4, 4) == 0);
+	ASSERT(pixel_is(1, 0, 0, 0, 0, 0));
+	d_blit(&t, 0, 0, 4, 4, fb.width - 1, fb.height - 1);
+	ASSERT(memcmp(pixel(fb.width - 1, fb.height - 1), data, 4) == 0);
+
+	// clipped by the texture
+	d_blit(&t, 2, 2, 4, 4, 10, 0);
+	ASSERT(memcmp(pixel(11, 1), data + (3 * 4 + 3) * 4, 4) == 0);
+	ASSERT(pixel_is(12, 0, 0, 0, 0, 0));
+	d_end();
+
+	d_texture_free(&t);
+}
+
+static void test_blit_intensity()
+{
+	struct d_texture t;
+	d_texture_init(&t, 2, 1);
+	uint8_t data[] = {0x80, 0xff};
+	d_texture_sub_image_intensity(&t, 0, 0, 2, 1, data);
+
+	AN(d_begin(0));
+	d_set_color(rgba(1, 0, 0, 1));
+	d_blit(&t, 0, 0, 2, 1, 0, 0);
+	ASSERT(pixel_is(0, 0, 0x80, 0, 0, 0x80));
+	ASSERT(pixel_is(1, 0, 0xff, 0, 0, 0xff));
+	d_end();
+
+	d_texture_free(&t);
+}
+
+static void test_main_atlas()
+{
+	uint8_t glyph[] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+	short x, y;
+	AZ(d_main_atlas_pack_intensity(3, 2, glyph, &x, &y));
+
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	d_blit(d_main_atlas_get_texture(), x, y, 3, 2, 4, 4);
+	for (int i = 0; i < 6; i++) {
+		uint8_t c = glyph[i];
+		ASSERT(pixel_is(4 + i % 3, 4 + i / 3, c, c, c, c));
+	}
+	d_end();
+}
+
+static uint32_t rng_state = 1;
+static uint8_t rng8()
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 16;
+}
+
+static void random_premultiplied(uint8_t* p, int n)
+{
+	for (int i = 0; i < n; i++) {
+		uint8_t a = rng8();
+		for (int j = 0; j < 3; j++) p[i * 4 + j] = mul255(rng8(), a);
+		p[i * 4 + 3] = a;
+	}
+}
+
+static void test_spans_match_scalar()
+{
+	uint8_t dst0[40 * 4], dst1[40 * 4], src[40 * 4], color[4];
+	for (int iter = 0; iter < 1000; iter++) {
+		int n = rng8() % 40;
+		random_premultiplied(dst0, n);
+		random_premultiplied(src, n);
+		random_premultiplied(color, 1);
+		if (iter & 1) color[3] = 255;
+
+		memcpy(dst1, dst0, n * 4);
+		span_fill(dst0, n, color);
+		span_fill_scalar(dst1, n, color);
+		ASSERT(memcmp(dst0, dst1, n * 4) == 0);
+
+		span_blit(dst0, src, n, color);
+		span_blit_scalar(dst1, src, n, color);
+		ASSERT(memcmp(dst0, dst1, n * 4) == 0);
+	}
+}
+
+static void test_frame_printf()
+{
+	d_inc_frame_tag();
+	char* s = d_frame_printf("frame %d", 1);
+	ASSERT(strcmp(s, "frame 1") == 0);
+	d_inc_frame_tag();
+	ASSERT(strcmp(s, "frame 1") == 0); // still valid during the next frame
+}
+
+// sum of alpha, and the bounds of the pixels that have any
+static int coverage(struct d_box* ink)
+{
+	int sum = 0;
+	*ink = (struct d_box) { .x0 = fb.width, .y0 = fb.height };
+	for (int y = 0; y < fb.height; y++) {
+		for (int x = 0; x < fb.width; x++) {
+			int a = pixel(x, y)[3];
+			if (a == 0) continue;
+			sum += a;
+			if (x < ink->x0) ink->x0 = x;
+			if (y < ink->y0) ink->y0 = y;
+			if (x >= ink->x1) ink->x1 = x + 1;
+			if (y >= ink->y1) ink->y1 = y + 1;
+		}
+	}
+	return sum;
+}
+
+// draws str with its baseline at y; returns its coverage
+static int draw_str(int font, float x, float y, char* str, struct d_box* ink)
+{
+	d_damage_all();
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	d_text_set_cursor(x, y);
+	AZ(d_str(font, str));
+	d_end();
+	return coverage(ink);
+}
+
+static void test_font()
+{
+	d_soft_set_size(64, 32);
+
+	// H sits on the baseline, cap height (~0.7em) above it
+	struct d_box ink;
+	int h = draw_str(font, 10, 24, "H", &ink);
+	ASSERT(h > 0);
+	ASSERT(ink.y1 == 24);
+	ASSERT(ink.y0 >= 24 - 16 && ink.y0 <= 24 - 12);
+	ASSERT(ink.x0 >= 10 && ink.x1 <= 10 + 16);
+	// white in, premultiplied gray levels out
+	for (int i = 0; i < 64 * 32; i++) {
+		uint8_t* p = fb.pixels + i * 4;
+		ASSERT(p[0] == p[3] && p[1] == p[3] && p[2] == p[3]);
+	}
+
+	// glyphs are blitted as cached; moving by whole pixels moves the ink
+	struct d_box ink2;
+	ASSERT(draw_str(font, 30, 20, "H", &ink2) == h);
+	ASSERT(ink2.x0 == ink.x0 + 20 && ink2.y0 == ink.y0 - 4);
+	ASSERT(ink2.x1 == ink.x1 + 20 && ink2.y1 == ink.y1 - 4);
+
+	// side by side, advancing by the glyph's width
+	ASSERT(draw_str(font, 2, 24, "HH", &ink2) == h * 2);
+	int w = ink.x1 - ink.x0;
+	ASSERT(ink2.x1 - ink2.x0 > w * 2);
+}
+
+static void test_scene_frames_dont_allocate()
+{
+	d_soft_set_size(640, 480);
+	d_set_frame_allocs_check(D_FRAME_ALLOCS_ASSERT);
+	for (int i = 0; i < SCENE_FRAMES; i++) draw_scene_frame(SCENE_WARMUP + i);
+	d_set_frame_allocs_check(D_FRAME_ALLOCS_ALLOW);
+	struct d_frame_allocs f;
+	d_get_frame_allocs(&f);
+	AZ(f.n_mem);
+	AZ(f.n_slab);
+	AZ(f.n_scratch_grows);
+}
+
+static void test_damage()
+{
+	AN(d_begin(0));
+	d_set_color(rgba(1, 1, 1, 1));
+	d_rect(0, 0, 16, 16);
+	d_end();
+
+	// nothing changed; frame is skipped
+	AZ(d_has_damage());
+	AZ(d_begin(0));
+
+	// only the damage is cleared and redrawn
+	d_damage(2, 3, 4, 5);
+	d_damage(20, 20, 4, 4); // off screen
+	AN(d_has_damage());
+	AN(d_begin(0));
+	int n;
+	struct d_box bounds;
+	d_get_damage(&n, &bounds);
+	ASSERT(n == 1);
+	ASSERT(bounds.x0 == 2 && bounds.y0 == 3 && bounds.x1 == 6 && bounds.y1 == 8);
+	d_set_color(rgba(1, 0, 0, 1));
+	d_rect(-100, -100, 1000, 1000);
+	d_blit(d_main_atlas_get_texture(), 0, 0, 16, 16, 0, 0); // transparent
+	for (int y = 0; y < fb.height; y++) {
+		for (int x = 0; x < fb.width; x++) {
+			int inside = x >= 2 && x < 6 && y >= 3 && y < 8;
+			ASSERT(inside ? pixel_is(x, y, 255, 0, 0, 255) : pixel_is(x, y, 255, 255, 255, 255));
+		}
+	}
+	d_end();
+	AZ(d_begin(0));
+
+	// damage only off screen is dropped, not kept around
+	d_damage(20, 20, 4, 4);
+	AZ(d_begin(0));
+	AZ(d_has_damage());
+	AZ(d_begin(0));
+
+	// too many rectangles are merged into their bounds
+	for (int i = 0; i < D_MAX_DAMAGE + 1; i++) d_damage(i % 8, i / 8, 1, 1);
+	AN(d_begin(0));
+	d_get_damage(&n, &bounds);
+	ASSERT(n == 1);
+	ASSERT(bounds.x0 == 0 && bounds.y0 == 0 && bounds.x1 == 8 && bounds.y1 == 3);
+	d_end();
+
+	// a resize damages everything
+	d_soft_set_size(8, 8);
+	AN(d_begin(0));
+	d_get_damage(&n, &bounds);
+	ASSERT(bounds.x0 == 0 && bounds.y0 == 0 && bounds.x1 == 8 && bounds.y1 == 8);
+	d_end();
+}
+
+static void test_damage_buffer_age()
+{
+	AN(d_begin(0));
+	d_end();
+	d_damage(0, 0, 1, 1);
+	AN(d_begin(0));
+	d_end();
+	d_damage(4, 4, 1, 1);
+	AN(d_begin(0));
+	d_end();
+
+	// a back buffer 3 frames old misses the last 2 frames' damage
+	d_damage(8, 8, 1, 1);
+	int n;
+	struct d_box bounds;
+	AN(d_damage_begin(16, 16, 3));
+	d_get_damage(&n, &bounds);
+	ASSERT(n == 3);
+	ASSERT(bounds.x0 == 0 && bounds.y0 == 0 && bounds.x1 == 9 && bounds.y1 == 9);
+	d_damage_end();
+
+	// unknown contents; everything is redrawn
+	d_damage(8, 8, 1, 1);
+	AN(d_damage_begin(16, 16, 0));
+	d_get_damage(&n, &bounds);
+	ASSERT(n == 1);
+	ASSERT(bounds.x0 == 0 && bounds.y0 == 0 && bounds.x1 == 16 && bounds.y1 == 16);
+	d_damage_end();
+}
+
+static void fail_on_draw_outside_begin()
+{
+	ut_assert = "ASSERT((draw_scope.begun) != 0) failed in d_rect";
+	d_rect(0, 0, 1, 1);
+}
+
+static int initialized;
+
+void pre_test()
+{
+	if (!initialized) {
+		d_init();
+		font = d_open_font("builtin:Aileron-Regular.otf", 20);
+		ASSERT(font >= 0);
+		/* the atlas, glyph cache and font are kept for all tests; what
+		 * they allocate while warming up isn't a leak */
+		d_soft_set_size(640, 480);
+		for (int i = 0; i < SCENE_WARMUP; i++) draw_scene_frame(i);
+		ut_allocations = ut_frees = 0;
+		initialized = 1;
+	}
+	d_soft_set_size(16, 16);
+	draw_scope.begun = 0;
+}
+
+void post_test()
+{
+}
+
+void run_tests()
+{
+	TEST(test_rect);
+	TEST(test_rect_covers_pixel_centers);
+	TEST(test_premultiplied_blend);
+	TEST(test_vertical_shade);
+	TEST(test_blit);
+	TEST(test_blit_intensity);
+	TEST(test_main_atlas);
+	TEST(test_spans_match_scalar);
+	TEST(test_frame_printf);
+	TEST(test_font);
+	TEST(test_scene_frames_dont_allocate);
+	TEST(test_damage);
+	TEST(test_damage_buffer_age);
+	TEST(fail_on_draw_outside_begin);
+}
+
+#endif
+
+#ifdef BENCHMARK
+
+#define BENCH_WIDTH (1920)
+#define BENCH_HEIGHT (1080)
+#define BENCH_FRAMES (50)
+
+static void report(const char* what, double dt, double pixels)
+{
+	printf("%s: %.1fms/frame, %.0f Mpixels/s\n", what, dt * 1e3 / BENCH_FRAMES, pixels / dt * 1e-6);
+}
+
+static void bench_rects()
+{
+	double t0 = bench_time();
+	for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+		d_damage_all();
+		AN(d_begin(0));
+		d_set_vertical_shade(
+			(union vec4) { .r = 0.5, .g = 0.4, .b = 0.3, .a = 0.5 },
+			(union vec4) { .r = 0.1, .g = 0.1, .b = 0.1, .a = 0.25 });
+		for (int i = 0; i < 8; i++) d_rect(i * 8, i * 8, BENCH_WIDTH, BENCH_HEIGHT);
+		d_end();
+	}
+	report("8 translucent full screen rects", bench_time() - t0, (double)BENCH_FRAMES * 8 * BENCH_WIDTH * BENCH_HEIGHT);
+}
+
+// text-like; 10x16 glyphs out of an intensity atlas
+static void bench_glyphs()
+{
+	struct d_texture t;
+	int n_glyphs = 128;
+	d_texture_init(&t, n_glyphs * 10, 16);
+	uint8_t* data = malloc(n_glyphs * 10 * 16);
+	for (int i = 0; i < n_glyphs * 10 * 16; i++) data[i] = bench_rng();
+	d_texture_sub_image_intensity(&t, 0, 0, n_glyphs * 10, 16, data);
+	free(data);
+
+	int n = 20000;
+	double t0 = bench_time();
+	for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+		d_damage_all();
+		AN(d_begin(0));
+		d_set_color((union vec4) { .r = 1, .g = 0.9, .b = 0.8, .a = 1 });
+		for (int i = 0; i < n; i++) {
+			int g = bench_rng() % n_glyphs;
+			d_blit(&t, g * 10, 0, 10, 16, bench_rng() % BENCH_WIDTH, bench_rng() % BENCH_HEIGHT);
+		}
+		d_end();
+	}
+	report("20000 glyphs", bench_time() - t0, (double)BENCH_FRAMES * n * 10 * 16);
+
+	d_texture_free(&t);
+}
+
+static void bench_spans()
+{
+	int n = BENCH_WIDTH;
+	uint8_t* dst = calloc(n, 4);
+	uint8_t* src = malloc(n * 4);
+	for (int i = 0; i < n * 4; i++) src[i] = bench_rng() & 0x7f;
+	uint8_t color[4] = {200, 100, 50, 200};
+	int iters = 20000;
+
+	double t0 = bench_time();
+	for (int i = 0; i < iters; i++) span_blit_scalar(dst, src, n, color);
+	double scalar = bench_time() - t0;
+	t0 = bench_time();
+	for (int i = 0; i < iters; i++) span_blit(dst, src, n, color);
+	double simd = bench_time() - t0;
+	printf("span_blit: %.0f Mpixels/s scalar, %.0f Mpixels/s%s (%.1fx)\n",
+		(double)iters * n / scalar * 1e-6,
+		(double)iters * n / simd * 1e-6,
+		#ifdef __SSE2__
+		" SSE2",
+		#else
+		" (no SSE2)",
+		#endif
+		scalar / simd);
+
+	free(dst);
+	free(src);
+}
+
+void run_benchmarks()
+{
+	d_init();
+	d_soft_set_size(BENCH_WIDTH, BENCH_HEIGHT);
+	BENCH(bench_rects);
+	BENCH(bench_glyphs);
+	BENCH(bench_spans);
+}
+
+#endif
@@ -1,8 +1,14 @@
 #ifndef DECKARD_H
 
+#include <stdint.h>
+
 #define DECKARD_WINDOW_TITLE ("Deckard")
 
 #define ARRAY_SIZE(array) (sizeof(array)/sizeof(*array))
 
+/* draws animation frame anim_frame of the scene (deckard_scene.c), between
+ * d_begin() and d_end() */
+void deckard_draw(int font_handle, uint64_t anim_frame);
+
 #define DECKARD_H
 #endif
@@ -1,13 +1,50 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "scratch.h"
+#include "mem.h"
+#include "slab.h"
+#include "alloc_trace.h"
 #include "win.h"
 #include "d.h"
 #include "log.h"
+#include "deckard.h"
 
 struct scratch main_thread_scratch;
 
+/* "deckard -check-frame-allocs" renders the scene for FRAME_CHECK_FRAMES
+ * frames after FRAME_CHECK_WARMUP frames of warm-up, asserting that none of
+ * them allocate, and exits */
+#define FRAME_CHECK_WARMUP (100)
+#define FRAME_CHECK_FRAMES (500)
+
+// animation frames are paced to this, in case presenting doesn't wait for vsync
+#define FRAME_INTERVAL_NS (16666667)
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int app_main(int argc, char** argv)
 {
-	scratch_init(&main_thread_scratch, 1<<28); // 256M
+	int check_frame_allocs = argc > 1 && strcmp(argv[1], "-check-frame-allocs") == 0;
+
+#ifdef USE_HUGE_PAGES
+	scratch_init_huge(&main_thread_scratch, 0);
+	if (slab_set_huge_pages(1) == -1) warnf("transparent huge pages not available");
+#else
+	scratch_init(&main_thread_scratch, 0);
+#endif
+
+#ifdef ALLOC_TRACE
+	const char* trace_path = getenv("DECKARD_ALLOC_TRACE");
+	if (trace_path != NULL && alloc_trace_start(trace_path) == -1) warnf("could not open %s for writing", trace_path);
+#endif
 
 	win_id main_window = win_open();
 	win_make_current(main_window); // d_init will fail without this
@@ -20,38 +57,86 @@ int app_main(int argc, char** argv)
 		return 1;
 	}
 
+	/* nothing is rendered unless something was damaged (by events, or by
+	 * the animation); otherwise the loop sleeps in win_wait(). 'a' toggles
+	 * the animation */
+	int animating = check_frame_allocs;
+	uint64_t anim_frame = 0;
+	uint64_t next_frame_ns = 0;
+	int win_width;
+	int win_height;
+	win_get_size(main_window, &win_width, &win_height);
+
 	int exiting = 0;
 	while (!exiting) {
+		int timeout_ms = -1;
+		if (d_has_damage()) {
+			timeout_ms = 0;
+		} else if (animating) {
+			uint64_t now = now_ns();
+			timeout_ms = next_frame_ns > now ? (next_frame_ns - now + 999999) / 1000000 : 0;
+		}
+		win_wait(timeout_ms);
+
 		struct win_event e;
 		while (win_poll_event(&e)) {
 			switch (e.type) {
 				case EV_KEYDOWN:
 					if (e.key.sym == 'q') exiting = 1;
+					if (e.key.sym == 'a') animating = !animating;
+#ifdef MEM_PROFILE
+					if (e.key.sym == 'm') mem_profile_dump(MEM_PROFILE_TOP);
+#endif
 					break;
 				case EV_BUTTONDOWN:
 					break;
+				case EV_EXPOSE:
+					d_damage(e.expose.x, e.expose.y, e.expose.width, e.expose.height);
+					break;
+				case EV_RESIZE:
+					if (e.resize.width != win_width || e.resize.height != win_height) {
+						win_width = e.resize.width;
+						win_height = e.resize.height;
+						d_damage_all();
+					}
+					break;
 			}
 		}
 
-		d_inc_frame_tag();
+		// the band the text moves in (see deckard_draw())
+		if (animating && now_ns() >= next_frame_ns) {
+			anim_frame++;
+			next_frame_ns = now_ns() + FRAME_INTERVAL_NS;
+			d_damage(0, 0, win_width, 20 + (int)(anim_frame / 64) + 64);
+		}
+
+		if (!d_has_damage()) continue;
 
-		d_begin(main_window);
+		if (check_frame_allocs) {
+			uint64_t tag = d_get_frame_tag();
+			if (tag == FRAME_CHECK_WARMUP) d_set_frame_allocs_check(D_FRAME_ALLOCS_ASSERT);
+			if (tag == FRAME_CHECK_WARMUP + FRAME_CHECK_FRAMES) {
+				printf("%d frames without allocations\n", FRAME_CHECK_FRAMES);
+				exiting = 1;
+			}
+		}
 
-		d_set_vertical_shade(
-			(union vec4) { .r = 1, .g = 0.9, .b = 0.8, .a = 0.0 },
-			(union vec4) { .r = 0.5, .g = 0.25, .b = 0.125, .a = 0.0 }
-		);
-		d_text_set_cursor(20.0 + ((float)d_get_frame_tag()) / 32.0, 20 + ((float)d_get_frame_tag()) / 64.0);
-		d_printf(font_handle, "hello world HELLO WORLD!!?@#!$^&*( joeqsixpack@gmail.com\nframe tag: %ld", d_get_frame_tag());
-		d_rect(100, 200, 500, 30);
+		d_inc_frame_tag();
 
-		d_end();
+		if (d_begin(main_window)) {
+			deckard_draw(font_handle, anim_frame);
+			d_end();
 
-		win_flip(main_window);
+			d_flip(main_window);
+		}
 	}
 
 	d_close_font(font_handle);
 
+#ifdef ALLOC_TRACE
+	alloc_trace_stop();
+#endif
+
 	return 0;
 }
 
@@ -0,0 +1,20 @@
+#include "d.h"
+#include "deckard.h"
+
+/* the text moves and changes every animation frame; the rect below it
+ * stays, and only needs redrawing when the text reaches it */
+void deckard_draw(int font_handle, uint64_t anim_frame)
+{
+	float text_x = 20.0 + ((float)anim_frame) / 32.0;
+	float text_y = 20 + ((float)anim_frame) / 64.0;
+
+	d_set_vertical_shade(
+		(union vec4) { .r = 1, .g = 0.9, .b = 0.8, .a = 0.0 },
+		(union vec4) { .r = 0.5, .g = 0.25, .b = 0.125, .a = 0.0 }
+	);
+	d_layer_begin();
+	d_text_set_cursor(text_x, text_y);
+	d_printf(font_handle, "hello world HELLO WORLD!!?@#!$^&*( joeqsixpack@gmail.com\nframe: %ld", anim_frame);
+	d_rect(100, 200, 500, 30);
+	d_layer_end();
+}
@@ -1,30 +1,392 @@
 #include <stdlib.h>
+#include <stdint.h>
+
+#define UNITTEST_REAL_MEM
+#include "unittest.h"
 
 #include "mem.h"
 #include "a.h"
+#include "alloc_trace.h"
+
+static __thread uint64_t n_thread_allocs;
+
+uint64_t mem_thread_allocs()
+{
+	return n_thread_allocs;
+}
+
+#ifndef MEM_PROFILE
 
 void* mem_alloc(size_t sz)
 {
+	n_thread_allocs++;
 	void* p = malloc(sz);
 	AN(p);
+	ALLOC_TRACE_EVENT(ALLOC, MEM, p, NULL, sz);
 	return p;
 }
 
 void* mem_calloc(size_t sz)
 {
+	n_thread_allocs++;
 	void* p = calloc(1, sz);
 	AN(p);
+	ALLOC_TRACE_EVENT(ALLOC, MEM, p, NULL, sz);
 	return p;
 }
 
 void* mem_realloc(void* p, size_t sz)
 {
+#ifdef ALLOC_TRACE
+	uintptr_t old = (uintptr_t)p; // p is dead after realloc
+#endif
+	n_thread_allocs++;
 	p = realloc(p, sz);
 	AN(p);
+	ALLOC_TRACE_EVENT(REALLOC, MEM, p, old, sz);
 	return p;
 }
 
 void mem_free(void* p)
 {
+	if (p != NULL) ALLOC_TRACE_EVENT(FREE, MEM, p, NULL, 0);
 	free(p);
 }
+
+void mem_profile_dump(int n)
+{
+}
+
+#else
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* every allocation is preceded by a header naming its site; 16 bytes so
+ * malloc's alignment is kept */
+struct header {
+	uint32_t site;
+	uint32_t magic;
+	uint64_t sz;
+};
+
+#define HEADER_MAGIC (0x6d656d70) // "memp"
+
+struct site {
+	const char* file; // NULL if unused
+	int line;
+	uint64_t n_allocs, n_frees;
+	uint64_t bytes_allocated;
+	size_t live, peak;
+};
+
+/* open addressing on file:line; sites are never removed. when full, new
+ * sites are counted in the last entry */
+#define MAX_SITES_LOG2 (12)
+#define MAX_SITES (1 << MAX_SITES_LOG2)
+#define OTHER_SITE (MAX_SITES)
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct site sites[MAX_SITES + 1];
+static int n_sites;
+static pthread_once_t dump_at_exit_once = PTHREAD_ONCE_INIT;
+
+static void dump_at_exit()
+{
+	mem_profile_dump(MEM_PROFILE_TOP);
+}
+
+static void register_dump_at_exit()
+{
+	atexit(dump_at_exit);
+}
+
+// the same file may come as different string literals from different units
+static int lookup_site_locked(const char* file, int line)
+{
+	uint32_t h = 2166136261u;
+	for (const char* c = file; *c; c++) h = (h ^ (uint8_t)*c) * 16777619u;
+	h = (h ^ line) * 16777619u;
+	for (int i = 0; i < MAX_SITES; i++) {
+		int j = (h + i) & (MAX_SITES - 1);
+		struct site* s = &sites[j];
+		if (s->file == NULL) {
+			// keep some room so probes stay short
+			if (n_sites >= MAX_SITES * 3 / 4) break;
+			n_sites++;
+			s->file = file;
+			s->line = line;
+			return j;
+		}
+		if (s->line == line && (s->file == file || strcmp(s->file, file) == 0)) return j;
+	}
+	sites[OTHER_SITE].file = "(other)";
+	return OTHER_SITE;
+}
+
+static void* track(struct header* h, size_t sz, const char* file, int line)
+{
+	AN(h);
+	n_thread_allocs++;
+	pthread_once(&dump_at_exit_once, register_dump_at_exit);
+	pthread_mutex_lock(&profile_lock);
+	int i = lookup_site_locked(file, line);
+	struct site* s = &sites[i];
+	s->n_allocs++;
+	s->bytes_allocated += sz;
+	s->live += sz;
+	if (s->live > s->peak) s->peak = s->live;
+	pthread_mutex_unlock(&profile_lock);
+	h->site = i;
+	h->magic = HEADER_MAGIC;
+	h->sz = sz;
+	return h + 1;
+}
+
+// returns the header of p
+static struct header* untrack(void* p)
+{
+	struct header* h = (struct header*)p - 1;
+	ASSERT(h->magic == HEADER_MAGIC); // not from mem_alloc*(), or freed already
+	h->magic = 0;
+	pthread_mutex_lock(&profile_lock);
+	struct site* s = &sites[h->site];
+	s->n_frees++;
+	s->live -= h->sz;
+	pthread_mutex_unlock(&profile_lock);
+	return h;
+}
+
+void* mem_alloc_at(size_t sz, const char* file, int line)
+{
+	void* p = track(malloc(sizeof(struct header) + sz), sz, file, line);
+	ALLOC_TRACE_EVENT(ALLOC, MEM, p, NULL, sz);
+	return p;
+}
+
+void* mem_calloc_at(size_t sz, const char* file, int line)
+{
+	void* p = track(calloc(1, sizeof(struct header) + sz), sz, file, line);
+	ALLOC_TRACE_EVENT(ALLOC, MEM, p, NULL, sz);
+	return p;
+}
+
+void* mem_realloc_at(void* p, size_t sz, const char* file, int line)
+{
+	if (p == NULL) return mem_alloc_at(sz, file, line);
+#ifdef ALLOC_TRACE
+	uintptr_t old = (uintptr_t)p; // p is dead after realloc
+#endif
+	struct header* h = untrack(p);
+	p = track(realloc(h, sizeof(struct header) + sz), sz, file, line);
+	ALLOC_TRACE_EVENT(REALLOC, MEM, p, old, sz);
+	return p;
+}
+
+void mem_free(void* p)
+{
+	if (p == NULL) return;
+	ALLOC_TRACE_EVENT(FREE, MEM, p, NULL, 0);
+	free(untrack(p));
+}
+
+// for code built without MEM_PROFILE
+#undef mem_alloc
+#undef mem_calloc
+#undef mem_realloc
+
+void* mem_alloc(size_t sz)
+{
+	return mem_alloc_at(sz, "?", 0);
+}
+
+void* mem_calloc(size_t sz)
+{
+	return mem_calloc_at(sz, "?", 0);
+}
+
+void* mem_realloc(void* p, size_t sz)
+{
+	return mem_realloc_at(p, sz, "?", 0);
+}
+
+static int site_peak_cmp(const void* va, const void* vb)
+{
+	const struct site* a = *(const struct site**)va;
+	const struct site* b = *(const struct site**)vb;
+	if (a->peak != b->peak) return a->peak < b->peak ? 1 : -1;
+	return a->live < b->live ? 1 : a->live > b->live ? -1 : 0;
+}
+
+void mem_profile_dump(int n)
+{
+	// static; allocating here would profile the profiler
+	static struct site copy[MAX_SITES + 1];
+	static struct site* order[MAX_SITES + 1];
+
+	pthread_mutex_lock(&profile_lock);
+	memcpy(copy, sites, sizeof(copy));
+	pthread_mutex_unlock(&profile_lock);
+
+	int n_used = 0;
+	size_t live = 0;
+	for (int i = 0; i <= MAX_SITES; i++) {
+		if (copy[i].file == NULL) continue;
+		order[n_used++] = &copy[i];
+		live += copy[i].live;
+	}
+	qsort(order, n_used, sizeof(*order), site_peak_cmp);
+
+	fprintf(stderr, "mem profile: %d sites, %.1f MiB live\n", n_used, live / 1048576.0);
+	fprintf(stderr, "%12s %12s %12s %12s %12s  site\n", "peak", "live", "allocated", "allocs", "frees");
+	for (int i = 0; i < n && i < n_used; i++) {
+		struct site* s = order[i];
+		fprintf(stderr, "%12zu %12zu %12llu %12llu %12llu  %s:%d\n",
+			s->peak, s->live,
+			(unsigned long long)s->bytes_allocated,
+			(unsigned long long)s->n_allocs,
+			(unsigned long long)s->n_frees,
+			s->file, s->line);
+	}
+}
+
+#ifdef UNITTEST
+
+static struct site* site_of(void* p)
+{
+	return &sites[((struct header*)p - 1)->site];
+}
+
+static void test_site_accounting()
+{
+	uint64_t n0 = mem_thread_allocs();
+	void* p = mem_alloc_at(100, "a.c", 1);
+	void* q = mem_calloc_at(50, "a.c", 1);
+	ASSERT(mem_thread_allocs() == n0 + 2);
+	struct site* s = site_of(p);
+	ASSERT(site_of(q) == s);
+	ASSERT(strcmp(s->file, "a.c") == 0 && s->line == 1);
+	ASSERT(s->n_allocs == 2);
+	ASSERT(s->bytes_allocated == 150);
+	ASSERT(s->live == 150 && s->peak == 150);
+
+	mem_free(p);
+	ASSERT(s->n_frees == 1);
+	ASSERT(s->live == 50 && s->peak == 150);
+	p = mem_alloc_at(10, "a.c", 1);
+	ASSERT(s->live == 60 && s->peak == 150);
+	mem_free(p);
+	mem_free(q);
+	ASSERT(s->live == 0 && s->peak == 150);
+	ASSERT(s->n_allocs == 3 && s->n_frees == 3);
+	ASSERT(s->bytes_allocated == 160);
+}
+
+static void test_sites_by_file_and_line()
+{
+	// same file as another string (as from another unit); same site
+	char file[] = "a.c";
+	void* p = mem_alloc_at(1, "a.c", 1);
+	void* q = mem_alloc_at(1, file, 1);
+	void* r = mem_alloc_at(1, "a.c", 2);
+	void* t = mem_alloc_at(1, "b.c", 1);
+	ASSERT(site_of(p) == site_of(q));
+	ASSERT(site_of(p) != site_of(r));
+	ASSERT(site_of(p) != site_of(t));
+	ASSERT(site_of(r) != site_of(t));
+	ASSERT(n_sites == 3);
+	mem_free(p);
+	mem_free(q);
+	mem_free(r);
+	mem_free(t);
+}
+
+static void test_realloc_moves_site()
+{
+	uint8_t* p = mem_alloc_at(100, "a.c", 1);
+	for (int i = 0; i < 100; i++) p[i] = i;
+	struct site* a = site_of(p);
+	p = mem_realloc_at(p, 1000, "b.c", 2);
+	for (int i = 0; i < 100; i++) ASSERT(p[i] == i);
+	struct site* b = site_of(p);
+	ASSERT(a != b);
+	ASSERT(a->live == 0 && a->peak == 100 && a->n_frees == 1);
+	ASSERT(b->live == 1000 && b->peak == 1000 && b->n_allocs == 1);
+
+	// from NULL, it's an allocation
+	void* q = mem_realloc_at(NULL, 10, "a.c", 1);
+	ASSERT(site_of(q) == a);
+	ASSERT(a->live == 10 && a->n_allocs == 2);
+	mem_free(p);
+	mem_free(q);
+	ASSERT(b->live == 0);
+}
+
+static void test_other_site()
+{
+	// sites fill up to 3/4 of the table, then go to "(other)"
+	int n = MAX_SITES * 3 / 4;
+	for (int i = 0; i < n + 10; i++) {
+		void* p = mem_alloc_at(8, "x.c", i);
+		if (i < n) {
+			ASSERT(site_of(p) != &sites[OTHER_SITE]);
+		} else {
+			ASSERT(site_of(p) == &sites[OTHER_SITE]);
+		}
+		mem_free(p);
+	}
+	struct site* o = &sites[OTHER_SITE];
+	ASSERT(strcmp(o->file, "(other)") == 0);
+	ASSERT(o->n_allocs == 10 && o->n_frees == 10 && o->live == 0 && o->peak == 8);
+
+	// known sites are still found
+	void* p = mem_alloc_at(8, "x.c", 0);
+	ASSERT(site_of(p) != o);
+	mem_free(p);
+}
+
+static void fail_on_double_free()
+{
+	void* p = mem_alloc_at(8, "a.c", 1);
+	mem_free(p);
+	ut_assert = "ASSERT(h->magic == HEADER_MAGIC) failed in untrack";
+	mem_free(p);
+}
+
+static void fail_on_free_of_foreign_pointer()
+{
+	uint64_t buf[4] = {0};
+	ut_assert = "ASSERT(h->magic == HEADER_MAGIC) failed in untrack";
+	mem_free(&buf[2]);
+}
+
+static void no_dump_at_exit()
+{
+}
+
+void pre_test()
+{
+	memset(sites, 0, sizeof(sites));
+	n_sites = 0;
+}
+
+void post_test()
+{
+}
+
+void run_tests()
+{
+	// the dump at exit would only be noise
+	pthread_once(&dump_at_exit_once, no_dump_at_exit);
+	TEST(test_site_accounting);
+	TEST(test_sites_by_file_and_line);
+	TEST(test_realloc_moves_site);
+	TEST(test_other_site);
+	TEST(fail_on_double_free);
+	TEST(fail_on_free_of_foreign_pointer);
+}
+
+#endif
+
+#endif
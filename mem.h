@@ -1,9 +1,32 @@
 #ifndef MEM_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 void* mem_alloc(size_t sz);
 void* mem_calloc(size_t sz);
 void* mem_realloc(void* p, size_t sz);
 void mem_free(void*);
 
+// number of mem_alloc*() calls made by the calling thread
+uint64_t mem_thread_allocs();
+
+/* MEM_PROFILE tags every allocation with the file:line that made it and
+ * keeps per call site counts, bytes allocated, and live and peak live bytes
+ * (a realloc moves its allocation to the realloc's call site).
+ * mem_profile_dump() prints the n sites with the highest peaks to stderr;
+ * the top MEM_PROFILE_TOP are printed at exit */
+#define MEM_PROFILE_TOP (20)
+void mem_profile_dump(int n);
+
+#ifdef MEM_PROFILE
+void* mem_alloc_at(size_t sz, const char* file, int line);
+void* mem_calloc_at(size_t sz, const char* file, int line);
+void* mem_realloc_at(void* p, size_t sz, const char* file, int line);
+#define mem_alloc(sz) mem_alloc_at(sz, __FILE__, __LINE__)
+#define mem_calloc(sz) mem_calloc_at(sz, __FILE__, __LINE__)
+#define mem_realloc(p, sz) mem_realloc_at(p, sz, __FILE__, __LINE__)
+#endif
+
 #define MEM_H
 #endif
@@ -0,0 +1,103 @@
+#ifndef POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "a.h"
+#include "slab.h"
+
+/* typed object pools on top of the slabs. POOL_DECLARE(name, type) declares
+ *
+ *   type* name_pool_alloc()
+ *   type* name_pool_calloc()
+ *   void name_pool_free(type*)
+ *   void name_pool_flush()
+ *   struct pool* name_pool_get()
+ *
+ * freed objects are kept on a per-thread intrusive LIFO (linked through
+ * their first word), so alloc/free is a couple of loads and stores. the
+ * slab is only visited to refill an empty pool, or to spill a full one,
+ * POOL_BATCH objects at a time, with the size class known at compile time.
+ * objects may be freed on any thread, to any pool of the same type. a
+ * thread's pooled objects are not returned to the slab when it exits; call
+ * name_pool_flush() before that */
+
+#define POOL_BATCH (32)
+#define POOL_MAX_FREE (256)
+
+struct pool {
+	void* free;
+	int n_free;
+	// the calling thread's counters
+	uint64_t n_allocs, n_frees;
+	uint64_t n_refills, n_spills; // slab round trips
+};
+
+static inline void* pool_refill(struct pool* pool, int size_class)
+{
+	void* ptrs[POOL_BATCH];
+	slab_alloc_many_class(size_class, ptrs, POOL_BATCH);
+	for (int i = 1; i < POOL_BATCH - 1; i++) *(void**)ptrs[i] = ptrs[i+1];
+	*(void**)ptrs[POOL_BATCH - 1] = NULL;
+	pool->free = ptrs[1];
+	pool->n_free = POOL_BATCH - 1;
+	pool->n_refills++;
+	return ptrs[0];
+}
+
+static inline void pool_spill(struct pool* pool, int n)
+{
+	void* ptrs[POOL_BATCH];
+	while (n > 0) {
+		int m = n < POOL_BATCH ? n : POOL_BATCH;
+		for (int i = 0; i < m; i++) {
+			ptrs[i] = pool->free;
+			pool->free = *(void**)pool->free;
+		}
+		pool->n_free -= m;
+		pool->n_spills++;
+		slab_free_many(ptrs, m);
+		n -= m;
+	}
+}
+
+#define POOL_DECLARE(name, type) \
+	typedef char name ## _pool_type_must_fit[sizeof(type) >= sizeof(void*) && sizeof(type) <= SLAB_MAX_ITEM_SIZE ? 1 : -1]; \
+	static __thread struct pool name ## _pool; \
+	static inline type* name ## _pool_alloc() \
+	{ \
+		struct pool* pool = &name ## _pool; \
+		pool->n_allocs++; \
+		void* p = pool->free; \
+		if (p == NULL) return pool_refill(pool, slab_size_class(sizeof(type))); \
+		pool->free = *(void**)p; \
+		pool->n_free--; \
+		return p; \
+	} \
+	static inline type* name ## _pool_calloc() \
+	{ \
+		type* p = name ## _pool_alloc(); \
+		memset(p, 0, sizeof(type)); \
+		return p; \
+	} \
+	static inline void name ## _pool_free(type* p) \
+	{ \
+		struct pool* pool = &name ## _pool; \
+		pool->n_frees++; \
+		if (pool->n_free == POOL_MAX_FREE) pool_spill(pool, POOL_BATCH); \
+		*(void**)p = pool->free; \
+		pool->free = p; \
+		pool->n_free++; \
+	} \
+	static inline void name ## _pool_flush() \
+	{ \
+		pool_spill(&name ## _pool, name ## _pool.n_free); \
+	} \
+	static inline struct pool* name ## _pool_get() \
+	{ \
+		return &name ## _pool; \
+	}
+
+#define POOL_H
+#endif
@@ -0,0 +1,375 @@
+#include <string.h>
+
+#include "unittest.h"
+
+#include "a.h"
+#include "sys.h"
+#include "scratch.h"
+
+/* memory is committed in steps of at least this much (and doubling), which
+ * also keeps committed ranges aligned for huge pages */
+#define COMMIT_LOG2 (SYS_VM_HUGE_PAGE_LOG2)
+#define COMMIT_SIZE ((size_t)1 << COMMIT_LOG2)
+
+static inline size_t round_up(size_t sz)
+{
+	return (sz + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1);
+}
+
+static __thread uint64_t n_thread_grows;
+
+static void init(struct scratch* ms, size_t sz, int huge)
+{
+	memset(ms, 0, sizeof(*ms));
+	ms->reserved = (size_t)1 << SCRATCH_RESERVE_LOG2;
+	if (round_up(sz) > ms->reserved) ms->reserved = round_up(sz);
+	AN(ms->mem = sys_vm_reserve(ms->reserved, COMMIT_LOG2));
+	ms->huge = huge;
+	ms->owner = pthread_self();
+	if (sz > 0) scratch_grow(ms, sz);
+}
+
+void scratch_init(struct scratch* ms, size_t sz)
+{
+	init(ms, sz, 0);
+}
+
+void scratch_init_huge(struct scratch* ms, size_t sz)
+{
+	init(ms, sz, 1);
+}
+
+void scratch_release(struct scratch* ms)
+{
+	sys_vm_release(ms->mem, ms->reserved);
+	memset(ms, 0, sizeof(*ms));
+}
+
+void scratch_grow(struct scratch* ms, size_t top)
+{
+	ASSERT(top <= ms->reserved); // scratch reservation used up
+	if (top <= ms->committed) return;
+
+	// untouched pages cost nothing, so doubling only saves syscalls
+	size_t committed = round_up(top);
+	if (committed < ms->committed * 2) committed = ms->committed * 2;
+	if (committed > ms->reserved) committed = ms->reserved;
+
+	n_thread_grows++;
+	uint8_t* p = ms->mem + ms->committed;
+	size_t sz = committed - ms->committed;
+	if (ms->huge) sys_vm_advise_huge(p, sz, 1);
+	AZ(sys_vm_commit(p, sz));
+	ms->committed = committed;
+}
+
+uint64_t scratch_thread_grows()
+{
+	return n_thread_grows;
+}
+
+void scratch_trim(struct scratch* ms)
+{
+	if (ms->top > ms->high) ms->high = ms->top;
+	// twice the need leaves room for jitter without committing again
+	size_t keep = round_up(ms->high * 2);
+	if (keep < ms->committed) {
+		AZ(sys_vm_decommit(ms->mem + keep, ms->committed - keep));
+		ms->committed = keep;
+		// decommitted memory comes back zeroed
+		if (ms->poisoned_top > keep) ms->poisoned_top = keep;
+	}
+	ms->high = ms->top;
+	ms->n_set_tops = 0;
+}
+
+
+void scratch_debug_alloc(struct scratch* ms, size_t new_top)
+{
+	ASSERT(pthread_equal(ms->owner, pthread_self())); // scratch used by another thread
+	size_t end = new_top < ms->poisoned_top ? new_top : ms->poisoned_top;
+	for (size_t i = ms->top; i < end; i++) {
+		ASSERT(ms->mem[i] == SCRATCH_POISON_BYTE); // written to after its scope was left
+	}
+	if (ms->poisoned_top < new_top) ms->poisoned_top = new_top;
+}
+
+void scratch_debug_set_top(struct scratch* ms, size_t top)
+{
+	ASSERT(pthread_equal(ms->owner, pthread_self())); // scratch used by another thread
+	ASSERT(top <= ms->top); // scope left twice, or out of order
+	memset(ms->mem + top, SCRATCH_POISON_BYTE, ms->top - top);
+}
+
+void scratch_debug_check(struct scratch* ms, void* p)
+{
+	ASSERT(pthread_equal(ms->owner, pthread_self())); // scratch used by another thread
+	ASSERT((size_t)((uint8_t*)p - ms->mem) < ms->top); // not live in this scratch
+}
+
+__thread struct scratch thread_scratch;
+static pthread_once_t thread_scratch_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_scratch_key;
+
+static void release_thread_scratch(void* arg)
+{
+	scratch_release(arg);
+}
+
+static void create_thread_scratch_key()
+{
+	AZ(pthread_key_create(&thread_scratch_key, release_thread_scratch));
+}
+
+struct scratch* thread_scratch_init()
+{
+	pthread_once(&thread_scratch_key_once, create_thread_scratch_key);
+	scratch_init(&thread_scratch, 0);
+	AZ(pthread_setspecific(thread_scratch_key, &thread_scratch));
+	return &thread_scratch;
+}
+
+
+#ifdef UNITTEST
+
+static struct scratch s;
+
+static void test_alloc()
+{
+	scratch_init(&s, 1000);
+	ASSERT(s.committed == COMMIT_SIZE);
+	size_t p0 = scratch_alloc(&s, 3);
+	size_t p1 = scratch_alloc(&s, 3);
+	size_t p2 = scratch_alloc_align_log2(&s, 1, 12);
+	ASSERT(p0 == 0);
+	ASSERT(p1 == 16);
+	ASSERT(p2 == 4096);
+	uint8_t* c = scratch_calloc_ptr(&s, 100);
+	for (int i = 0; i < 100; i++) AZ(c[i]);
+	ASSERT(s.committed == COMMIT_SIZE);
+}
+
+static void test_pointers_survive_growth()
+{
+	scratch_init(&s, 4096);
+	uint8_t* mem0 = s.mem;
+
+	// fill a pointer per allocation, growing well past the initial commit
+	int n = 0;
+	uint32_t* ptrs[32];
+	size_t sz = 1 << 16;
+	while (n < 32) {
+		uint32_t* p = scratch_alloc_ptr(&s, sz);
+		for (size_t i = 0; i < sz / 4; i++) p[i] = n * 1000003 + i;
+		ptrs[n++] = p;
+		sz += sz / 8;
+	}
+	ASSERT(s.top > 8 * COMMIT_SIZE);
+	ASSERT(s.committed >= s.top);
+
+	// nothing moved, nothing was lost
+	ASSERT(s.mem == mem0);
+	sz = 1 << 16;
+	for (int j = 0; j < n; j++) {
+		for (size_t i = 0; i < sz / 4; i++) ASSERT(ptrs[j][i] == j * 1000003 + i);
+		sz += sz / 8;
+	}
+}
+
+static void test_rewind_reuses_memory()
+{
+	scratch_init(&s, 0);
+	AZ(s.committed);
+	size_t top = s.top;
+	void* p = scratch_alloc_ptr(&s, 3 * COMMIT_SIZE);
+	size_t committed = s.committed;
+	scratch_set_top(&s, top);
+	ASSERT(scratch_alloc_ptr(&s, 3 * COMMIT_SIZE) == p);
+	ASSERT(s.committed == committed);
+}
+
+static void test_huge()
+{
+	scratch_init_huge(&s, 1);
+	AZ((uintptr_t)s.mem & (COMMIT_SIZE - 1));
+	uint8_t* p = scratch_alloc_ptr(&s, 5 * COMMIT_SIZE);
+	p[5 * COMMIT_SIZE - 1] = 1;
+	ASSERT(s.committed >= 5 * COMMIT_SIZE);
+}
+
+// runs a period of enter/alloc/leave cycles, peaking at sz bytes
+static void period(size_t sz)
+{
+	for (int i = 0; i < SCRATCH_TRIM_PERIOD; i++) {
+		size_t top = s.top;
+		scratch_alloc(&s, i == SCRATCH_TRIM_PERIOD / 2 ? sz : 16);
+		scratch_set_top(&s, top);
+	}
+}
+
+static void test_trim()
+{
+	scratch_init(&s, 0);
+	uint8_t* p = scratch_alloc_ptr(&s, 1);
+	*p = 42;
+	size_t top = s.top;
+
+	// a spike commits memory...
+	memset(scratch_alloc_ptr(&s, 20 * COMMIT_SIZE), 1, 20 * COMMIT_SIZE);
+	scratch_set_top(&s, top);
+	ASSERT(s.committed >= 20 * COMMIT_SIZE);
+
+	// ...that stays while the period with the spike lasts...
+	period(1000);
+	ASSERT(s.committed >= 20 * COMMIT_SIZE);
+
+	// ...and goes once a whole period stays low
+	period(1000);
+	ASSERT(s.committed == COMMIT_SIZE);
+	ASSERT(*p == 42);
+
+	// decommitted memory comes back (zeroed) when needed again
+	scratch_alloc(&s, 4 * COMMIT_SIZE);
+	for (size_t i = COMMIT_SIZE; i < 4 * COMMIT_SIZE; i += 4096) AZ(s.mem[i]);
+	ASSERT(s.committed >= 4 * COMMIT_SIZE);
+}
+
+static void test_no_trim_under_steady_use()
+{
+	scratch_init(&s, 0);
+	for (int i = 0; i < 4; i++) period(5 * COMMIT_SIZE);
+	size_t committed = s.committed;
+	ASSERT(committed >= 5 * COMMIT_SIZE);
+	for (int i = 0; i < 4; i++) period(5 * COMMIT_SIZE);
+	ASSERT(s.committed == committed);
+}
+
+static void* thread_scratch_worker(void* arg)
+{
+	TS_ENTER(0);
+	uint32_t* p = TS_alloc_ptr(1 << 20);
+	for (int i = 0; i < (1 << 18); i++) p[i] = (uintptr_t)arg + i;
+	TS_ENTER(1);
+	uint8_t* q = TS_calloc_ptr(100);
+	TS_CHECK(q);
+	TS_LEAVE(1);
+	for (int i = 0; i < (1 << 18); i++) ASSERT(p[i] == (uintptr_t)arg + i);
+	TS_CHECK(p);
+	void* mem = thread_scratch.mem;
+	TS_LEAVE(0);
+	return mem;
+}
+
+static void test_thread_scratch()
+{
+	pthread_t threads[4];
+	for (int i = 0; i < 4; i++) AZ(pthread_create(&threads[i], NULL, thread_scratch_worker, (void*)(uintptr_t)(i << 24)));
+	void* mems[4];
+	for (int i = 0; i < 4; i++) AZ(pthread_join(threads[i], &mems[i]));
+	for (int i = 0; i < 4; i++) AN(mems[i]);
+
+	// the main thread gets one of its own too
+	TS_ENTER(0);
+	TS_alloc_ptr(1);
+	TS_LEAVE(0);
+	AN(thread_scratch.mem);
+	ASSERT(pthread_equal(thread_scratch.owner, pthread_self()));
+}
+
+static void fail_on_write_after_leave()
+{
+	TS_ENTER(0);
+	uint8_t* p = TS_alloc_ptr(64);
+	TS_LEAVE(0);
+	p[10] = 1;
+	ut_assert = "ASSERT(ms->mem[i] == SCRATCH_POISON_BYTE) failed in scratch_debug_alloc";
+	TS_alloc_ptr(64);
+}
+
+static void fail_on_escaped_pointer()
+{
+	TS_ENTER(0);
+	void* p = TS_alloc_ptr(64);
+	TS_LEAVE(0);
+	ut_assert = "ASSERT((size_t)((uint8_t*)p - ms->mem) < ms->top) failed in scratch_debug_check";
+	TS_CHECK(p);
+}
+
+static void* alloc_in_thread(void* arg)
+{
+	return TS_alloc_ptr(64);
+}
+
+static void fail_on_pointer_from_other_thread()
+{
+	TS_alloc_ptr(64);
+	void* p;
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, alloc_in_thread, NULL));
+	AZ(pthread_join(thread, &p));
+	ut_assert = "ASSERT((size_t)((uint8_t*)p - ms->mem) < ms->top) failed in scratch_debug_check";
+	TS_CHECK(p);
+}
+
+static void* init_in_thread(void* arg)
+{
+	scratch_init(&s, 0);
+	return NULL;
+}
+
+static void fail_on_scratch_from_other_thread()
+{
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, init_in_thread, NULL));
+	AZ(pthread_join(thread, NULL));
+	ut_assert = "ASSERT(pthread_equal(ms->owner, pthread_self())) failed in scratch_debug_alloc";
+	scratch_alloc(&s, 64);
+}
+
+static void fail_on_leave_out_of_order()
+{
+	TS_ENTER(0);
+	TS_alloc(64);
+	TS_ENTER(1);
+	TS_alloc(64);
+	TS_LEAVE(0);
+	ut_assert = "ASSERT(top <= ms->top) failed in scratch_debug_set_top";
+	TS_LEAVE(1);
+}
+
+static void fail_past_reservation()
+{
+	scratch_init(&s, 4096);
+	ut_assert = "ASSERT(top <= ms->reserved) failed in scratch_grow";
+	scratch_alloc(&s, s.reserved + 1);
+}
+
+void pre_test()
+{
+	memset(&s, 0, sizeof(s));
+	if (thread_scratch.mem != NULL) scratch_release(&thread_scratch);
+}
+
+void post_test()
+{
+	if (s.mem != NULL) scratch_release(&s);
+}
+
+void run_tests()
+{
+	TEST(test_alloc);
+	TEST(test_pointers_survive_growth);
+	TEST(test_rewind_reuses_memory);
+	TEST(test_huge);
+	TEST(test_trim);
+	TEST(test_no_trim_under_steady_use);
+	TEST(test_thread_scratch);
+	TEST(fail_on_write_after_leave);
+	TEST(fail_on_escaped_pointer);
+	TEST(fail_on_pointer_from_other_thread);
+	TEST(fail_on_scratch_from_other_thread);
+	TEST(fail_on_leave_out_of_order);
+	TEST(fail_past_reservation);
+}
+
+#endif
@@ -1,43 +1,98 @@
 #ifndef SCRATCH_H
 
-#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "a.h"
-#include "log.h"
 
+/* a scratch is one big reservation of address space, committed on demand as
+ * top grows, so memory never moves: pointers from scratch_alloc_ptr() stay
+ * valid until top is moved back below them. when top has stayed far below
+ * the committed size for a while (see scratch_set_top()), the tail is
+ * decommitted so resident memory follows actual use */
 struct scratch {
-	void* mem;
-	size_t sz;
+	uint8_t* mem;
+	size_t reserved; // bytes of address space at mem
+	size_t committed; // bytes at mem backed by memory
 	size_t top;
+	size_t high; // high-water mark of top since the last trim check
+	int n_set_tops; // since the last trim check
+	int huge; // backed by transparent huge pages where possible
+	pthread_t owner; // thread that created it
+	size_t poisoned_top; // [top, poisoned_top) is poisoned (SCRATCH_DEBUG)
 };
 
-static inline void scratch_init(struct scratch* ms, size_t sz)
-{
-	memset(ms, 0,  sizeof(*ms));
-	AN(ms->mem = malloc(sz));
-	ms->sz = sz;
-}
+/* SCRATCH_DEBUG asserts that a scratch is only used by the thread that
+ * created it and that scopes are left innermost first. memory is poisoned
+ * with SCRATCH_POISON_BYTE as its scope is left and checked when handed out
+ * again, catching writes through pointers that escaped their scope, and
+ * MTS_CHECK()/TS_CHECK() assert that a pointer is live in the calling
+ * thread's scratch. PARANOID (unit tests) turns it on */
+#if defined(PARANOID) && !defined(SCRATCH_DEBUG)
+#define SCRATCH_DEBUG
+#endif
+#define SCRATCH_POISON_BYTE (0xdb)
+
+// address space reserved per scratch; only what's committed costs memory
+#define SCRATCH_RESERVE_LOG2 (36) // 64G
+
+/* every this many scratch_set_top() calls, memory beyond twice the
+ * high-water mark of the period is decommitted */
+#define SCRATCH_TRIM_PERIOD (1024)
+
+/* sz bytes are committed up front (the reservation is at least that big) */
+void scratch_init(struct scratch*, size_t sz);
+
+/* like scratch_init(), but backed by transparent huge pages where the
+ * kernel allows it, for fewer TLB misses in big scratches */
+void scratch_init_huge(struct scratch*, size_t sz);
+
+void scratch_release(struct scratch*);
+
+// commits memory so that top fits; slow path of scratch_alloc_align_log2()
+void scratch_grow(struct scratch*, size_t top);
+
+// number of times the calling thread committed more memory to a scratch
+uint64_t scratch_thread_grows();
+
+// decommits what the last period didn't need; slow path of scratch_set_top()
+void scratch_trim(struct scratch*);
+
+// SCRATCH_DEBUG checks; always built so debug and non-debug code can mix
+void scratch_debug_alloc(struct scratch*, size_t new_top);
+void scratch_debug_set_top(struct scratch*, size_t top);
+void scratch_debug_check(struct scratch*, void* p);
 
 static inline void* scratch_deref(struct scratch* ms, size_t p)
 {
-	return (void*)((char*)ms->mem + p);
+	return ms->mem + p;
 }
 
 static inline size_t scratch_alloc_align_log2(struct scratch* ms, size_t sz, int align_log2)
 {
 	size_t begin = ((ms->top + (1 << align_log2) - 1) >> align_log2) << align_log2;
 	size_t new_top = begin + sz;
-	size_t sz0 = ms->sz;
-	while (new_top > ms->sz) ms->sz *= 2;
-	if (ms->sz != sz0) {
-		warnf("resizing scratch from %zu to %zu bytes", sz0, ms->sz);
-		AN(ms->mem = realloc(ms->mem, ms->sz));
-	}
+	if (new_top > ms->committed) scratch_grow(ms, new_top);
+#ifdef SCRATCH_DEBUG
+	scratch_debug_alloc(ms, new_top);
+#endif
 	ms->top = new_top;
 	return begin;
 }
 
+/* moves top back (usually to where it was before a batch of temporary
+ * allocations), noting how high it went */
+static inline void scratch_set_top(struct scratch* ms, size_t top)
+{
+#ifdef SCRATCH_DEBUG
+	scratch_debug_set_top(ms, top);
+#endif
+	if (ms->top > ms->high) ms->high = ms->top;
+	ms->top = top;
+	if (++ms->n_set_tops == SCRATCH_TRIM_PERIOD) scratch_trim(ms);
+}
+
 static inline size_t scratch_alloc(struct scratch* ms, size_t sz)
 {
 	return scratch_alloc_align_log2(ms, sz, 4);
@@ -64,7 +119,7 @@ static inline void* scratch_calloc_ptr(struct scratch* ms, size_t sz)
 /* global scratch for main thread */
 extern struct scratch main_thread_scratch;
 #define MTS_get_top() main_thread_scratch.top
-#define MTS_set_top(p) do { main_thread_scratch.top = p; } while (0)
+#define MTS_set_top(p) scratch_set_top(&main_thread_scratch, p)
 #define MTS_ENTER(x) size_t _mts_top_ ## x = MTS_get_top()
 #define MTS_LEAVE(x) MTS_set_top(_mts_top_ ## x)
 #define MTS_deref(p) scratch_deref(&main_thread_scratch, p)
@@ -74,6 +129,30 @@ extern struct scratch main_thread_scratch;
 #define MTS_calloc(sz) scratch_calloc(&main_thread_scratch, sz)
 #define MTS_calloc_ptr(sz) scratch_calloc_ptr(&main_thread_scratch, sz)
 
+/* per-thread scratch, for temporaries on worker threads. created on a
+ * thread's first TS_*() and released when the thread exits */
+extern __thread struct scratch thread_scratch;
+struct scratch* thread_scratch_init();
+#define TS_scratch() (thread_scratch.mem != NULL ? &thread_scratch : thread_scratch_init())
+#define TS_get_top() TS_scratch()->top
+#define TS_set_top(p) scratch_set_top(TS_scratch(), p)
+#define TS_ENTER(x) size_t _ts_top_ ## x = TS_get_top()
+#define TS_LEAVE(x) TS_set_top(_ts_top_ ## x)
+#define TS_deref(p) scratch_deref(TS_scratch(), p)
+#define TS_alloc_align_log2(sz, align_log2) scratch_alloc_align_log2(TS_scratch(), sz, align_log2)
+#define TS_alloc(sz) scratch_alloc(TS_scratch(), sz)
+#define TS_alloc_ptr(sz) scratch_alloc_ptr(TS_scratch(), sz)
+#define TS_calloc(sz) scratch_calloc(TS_scratch(), sz)
+#define TS_calloc_ptr(sz) scratch_calloc_ptr(TS_scratch(), sz)
+
+#ifdef SCRATCH_DEBUG
+#define MTS_CHECK(p) scratch_debug_check(&main_thread_scratch, p)
+#define TS_CHECK(p) scratch_debug_check(TS_scratch(), p)
+#else
+#define MTS_CHECK(p)
+#define TS_CHECK(p)
+#endif
+
 
 #define SCRATCH_H
 #endif
@@ -1,399 +1,1366 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <pthread.h>
 
 #include "unittest.h"
+#include "benchmark.h"
 
 #include "a.h"
 #include "mem.h"
+#include "sys.h"
 
 #include "slab.h"
+#include "alloc_trace.h"
 
 #define ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2 (4)
 #define ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2 (16)
-#define NUM_SIZES (ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2 - ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2 + 1)
-#define MAX_SLABS_PER_ITEM_SIZE (256)
+#define ITEM_SIZE_MALLOC_THRESHOLD_MAX (1 << ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2)
+typedef char max_item_size_must_match_slab_h[ITEM_SIZE_MALLOC_THRESHOLD_MAX == SLAB_MAX_ITEM_SIZE ? 1 : -1];
+#ifdef UNITTEST
+#define MAX_SLABS_PER_ITEM_SIZE_LOG2 (9) // small enough for test_can_alloc_at_limit
+#else
+#define MAX_SLABS_PER_ITEM_SIZE_LOG2 (16)
+#endif
+#define MAX_SLABS_PER_ITEM_SIZE (1 << MAX_SLABS_PER_ITEM_SIZE_LOG2)
 #define SLAB_SPACE_LOG2 (20)
 #define MAX_ALLOCS_PER_SLAB_LOG2 (SLAB_SPACE_LOG2 - ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2)
 #if MAX_ALLOCS_PER_SLAB_LOG2 > 16
 #error "MAX_ALLOCS_PER_SLAB_LOG2 cannot exceed 16 (otherwise freelist_t must support it)"
 #endif
 typedef uint16_t freelist_t;
-#define MAX_PTR_RANGES (NUM_SIZES * MAX_SLABS_PER_ITEM_SIZE)
+
+/* SLAB_DEBUG keeps a live bit per allocation slot, flipped atomically on
+ * every alloc and free, so double frees (also of allocations sitting in a
+ * thread cache, or freed from another thread) and frees of slots that were
+ * never handed out are caught right away. SLAB_POISON additionally fills
+ * the first POISON_MAX bytes of freed allocations with POISON_BYTE and checks
+ * that it's intact when they are handed out again, catching writes after
+ * free. both are cheap enough for soak testing; PARANOID (unit tests) turns
+ * both on */
+#if defined(PARANOID) && !defined(SLAB_POISON)
+#define SLAB_POISON
+#endif
+#if defined(SLAB_POISON) && !defined(SLAB_DEBUG)
+#define SLAB_DEBUG
+#endif
+#define POISON_BYTE (0xdb)
+#define POISON_WORD (0xdbdbdbdbdbdbdbdbull)
+#define POISON_MAX (256)
+
+/* item sizes ("size classes"); multiples of 16 up to 64, then four per
+ * doubling (like jemalloc), so above 64 bytes the worst case internal
+ * fragmentation is 20% instead of the 50% of rounding up to a power of
+ * two. recip is used
+ * to turn a slab offset into an allocation index without dividing; it's
+ * exact for all offsets below 1<<SLAB_SPACE_LOG2 */
+struct size_class {
+	int item_size;
+	int max_allocations;
+	uint64_t recip;
+};
+#define RECIP_SHIFT (40)
+#define SC(sz) { sz, (1 << SLAB_SPACE_LOG2) / (sz), ((uint64_t)1 << RECIP_SHIFT) / (sz) + 1 }
+static const struct size_class size_classes[] = {
+	SC(16), SC(32), SC(48), SC(64),
+	SC(80), SC(96), SC(112), SC(128),
+	SC(160), SC(192), SC(224), SC(256),
+	SC(320), SC(384), SC(448), SC(512),
+	SC(640), SC(768), SC(896), SC(1024),
+	SC(1280), SC(1536), SC(1792), SC(2048),
+	SC(2560), SC(3072), SC(3584), SC(4096),
+	SC(5120), SC(6144), SC(7168), SC(8192),
+	SC(10240), SC(12288), SC(14336), SC(16384),
+	SC(20480), SC(24576), SC(28672), SC(32768),
+	SC(40960), SC(49152), SC(57344), SC(65536),
+};
+#undef SC
+#define NUM_SIZES (sizeof(size_classes) / sizeof(*size_classes))
+typedef char num_sizes_must_match_slab_h[NUM_SIZES == SLAB_NUM_SIZES ? 1 : -1];
+typedef char num_sizes_must_fit_in_64_bits[NUM_SIZES <= 64 ? 1 : -1];
+
+/* size -> size class, for sizes up to SIZE_CLASS_LUT_MAX; indexed by
+ * (sz+15)>>4. above that, classes are computed from the leading bits */
+#define SIZE_CLASS_LUT_MAX (1024)
+static const uint8_t size_class_lut[(SIZE_CLASS_LUT_MAX >> 4) + 1] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7,
+	8, 8, 9, 9, 10, 10, 11, 11,
+	12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+	16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
+	18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19,
+};
+
+/* all slabs live inside one reserved address range (slab_space), with one
+ * aligned region per item size, and one aligned 1<<SLAB_SPACE_LOG2 slot per
+ * slab inside that region. the size index and slab index of any pointer are
+ * thus found by masking/shifting its offset into slab_space; no lookup
+ * table required */
+#define SLAB_SIZE_SPACE_LOG2 (SLAB_SPACE_LOG2 + MAX_SLABS_PER_ITEM_SIZE_LOG2)
+#define SLAB_TOTAL_SPACE ((size_t)NUM_SIZES << SLAB_SIZE_SPACE_LOG2)
+
+/* with huge pages on (slab_set_huge_pages()), slabs are committed in
+ * aligned groups spanning a huge page whenever the rest of the group is
+ * free, so the first touch can fault in a whole huge page. a group is
+ * decommitted as a whole once all of its slabs are released */
+#if SYS_VM_HUGE_PAGE_LOG2 > SLAB_SPACE_LOG2
+#define HUGE_GROUP_LOG2 (SYS_VM_HUGE_PAGE_LOG2 - SLAB_SPACE_LOG2)
+#else
+#define HUGE_GROUP_LOG2 (0)
+#endif
+#define HUGE_GROUP_SIZE (1 << HUGE_GROUP_LOG2)
+#define SLAB_SPACE_ALIGN_LOG2 (SLAB_SPACE_LOG2 + HUGE_GROUP_LOG2)
+
+/* the slab table of a size is split into chunks of 1<<SLAB_CHUNK_LOG2
+ * slabs, allocated as the table grows and freed as it shrinks. chunks never
+ * move, so slab_free() can look up slabs without taking the lock */
+#define SLAB_CHUNK_LOG2 (8)
+#define SLAB_CHUNK_SIZE (1 << SLAB_CHUNK_LOG2)
+#define MAX_SLAB_CHUNKS ((MAX_SLABS_PER_ITEM_SIZE + SLAB_CHUNK_SIZE - 1) / SLAB_CHUNK_SIZE)
+
+/* allocations above ITEM_SIZE_MALLOC_THRESHOLD_MAX get their own mapping,
+ * with a LARGE_HEADER_SIZE header in front of the returned pointer. the
+ * header starts a page, so it's found without reading anything but the
+ * pointer itself; pointers outside slab_space are assumed to be large */
+#define LARGE_PAGE_SIZE (4096)
+#define LARGE_HEADER_SIZE (64)
+#define LARGE_MAGIC (0x1a26e0b1ec75a11dull)
+
+/* every thread allocates through its own struct slab_thread. it keeps a
+ * magazine (a small stack of free pointers) per size, which is refilled from
+ * and flushed to the slabs in batches of MAGAZINE_BATCH. each slab is owned
+ * by exactly one slab_thread, and only the owner touches its freelist, so no
+ * locks are needed outside of new_slab(). objects freed by another thread
+ * are pushed onto the owner's lock-free remote_frees stack instead, and are
+ * collected by the owner the next time its magazine runs dry. slab_threads
+ * are never freed; when a thread exits, its slab_thread (and the slabs it
+ * owns) is handed to the next thread that starts allocating */
+#define MAGAZINE_SIZE (64)
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+/* completely free slabs are kept around for reuse, up to this many per size
+ * per thread; the rest are released (decommitted) as soon as they become
+ * free. see slab_set_retained_empty_slabs() and slab_trim() */
+#define DEFAULT_RETAINED_EMPTY_SLABS (1)
+
+struct slab_thread;
 
 struct slab {
 	void* begin;
 	int n_allocated;
 	freelist_t* freelist;
+	struct slab_thread* owner;
+#ifdef SLAB_DEBUG
+	// bit per slot, allocated along with the freelist; atomic
+	uint64_t* live; // handed out and not freed
+	uint64_t* poisoned; // freed at least once, so it's filled with POISON_BYTE
+#endif
 };
 
 struct slab_size {
+	int n_active_slabs; // slab table high-water mark; may contain released slabs (begin == NULL)
+	int n_slabs; // number of slabs not released
+
+	// allocations out of the slabs (in use or cached in magazines); atomic
+	size_t n_out, n_peak_out;
+	// guarded by slab_lock
+	uint64_t n_new_slabs, n_released_slabs;
+
+	struct slab* chunks[MAX_SLAB_CHUNKS];
+};
+
+struct magazine {
+	int n;
+	void* ptrs[MAGAZINE_SIZE];
+};
+
+/* bit per slab index; set if owned by this thread and not full. the words
+ * grow with the slab table; summary has a bit per non-zero word, so finding
+ * a set bit is two ctz's per 4096 slabs */
+#define NONFULL_MIN_WORDS (SLAB_CHUNK_SIZE / 64)
+struct nonfull {
+	int n_words;
+	uint64_t* words;
+	uint64_t* summary;
+};
+
+struct slab_thread_size {
 	int last_used;
-	int n_active_slabs;
-	struct slab slabs[MAX_SLABS_PER_ITEM_SIZE];
+	int n_empty_slabs;
+	struct nonfull nonfull;
+	struct magazine magazine;
+
+	/* statistics; only written by the owning thread, so a relaxed
+	 * store is enough (slab_get_stats() may read them from another
+	 * thread) */
+	uint64_t n_allocs, n_frees, n_remote_frees, n_refills, n_flushes;
+	void* remote_frees; // intrusive stack; next pointer stored in the freed object
 };
 
-struct ptr_range {
-	void* p0;
-	int slab_size_index;
-	int slab_index;
+struct slab_thread {
+	int alive;
+	struct slab_thread* next;
+	struct slab_thread_size sizes[NUM_SIZES];
 };
 
+struct large_header {
+	size_t map_sz;
+	uint64_t magic; // LARGE_MAGIC ^ header address
+};
+typedef char large_header_must_fit[sizeof(struct large_header) <= LARGE_HEADER_SIZE ? 1 : -1];
+
+// large allocations; atomic
+static size_t n_large_live, bytes_large;
+static uint64_t n_large_allocs, n_large_frees;
+
 static struct slab_size slab_sizes[NUM_SIZES];
 
-static int n_ptr_ranges;
-static struct ptr_range ptr_ranges[MAX_PTR_RANGES];
+static uint8_t* slab_space;
+
+// guards slab_space reservation, new_slab() and the slab_threads list
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_thread_key;
+static struct slab_thread* slab_threads;
+static __thread struct slab_thread* current_thread;
+static __thread uint64_t n_thread_allocs; // through the public api
+static int retained_empty_slabs = DEFAULT_RETAINED_EMPTY_SLABS;
+static int huge_pages; // guarded by slab_lock
 
-static int in_ptr_range(void* p, int i)
+static inline void* get_slab_begin(int slab_size_index, int slab_index)
 {
-	struct ptr_range* pr = &ptr_ranges[i];
-	return p >= pr->p0 && p < (void*)((uint8_t*)pr->p0 + (1 << SLAB_SPACE_LOG2));
+	return slab_space + ((size_t)slab_size_index << SLAB_SIZE_SPACE_LOG2) + ((size_t)slab_index << SLAB_SPACE_LOG2);
 }
 
-static int ptr_range_index_bin_search(void* p)
+static inline int get_slab_size_index(size_t sz)
 {
-	int low = 0;
-	int high = n_ptr_ranges - 1;
-	while (low < high) {
-		int mid = (low + high) >> 1;
-		if (ptr_ranges[mid].p0 < p) {
-			low = mid + 1;
-		} else {
-			high = mid;
-		}
-	}
+	ASSERT(sz <= ITEM_SIZE_MALLOC_THRESHOLD_MAX);
+	if (sz <= SIZE_CLASS_LUT_MAX) return size_class_lut[(sz + 15) >> 4];
+	int i = slab_size_class(sz);
+	PARANOID_ASSERT(i < NUM_SIZES);
+	return i;
+}
+
+static inline int get_slab_size_index_for_sz_log2(int sz_log2)
+{
+	ASSERT(sz_log2 >= 0);
+	ASSERT(sz_log2 <= ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2);
+	return get_slab_size_index((size_t)1 << sz_log2);
+}
 
-	if (low != high) return -1;
-	return low;
+static inline int get_item_size(int slab_size_index)
+{
+	return size_classes[slab_size_index].item_size;
 }
 
-static struct ptr_range* ptr_range_bin_search(void* p)
+static inline int get_max_allocations(int slab_size_index)
 {
-	int pi = ptr_range_index_bin_search(p);
-	for (int i = 0; i < 2; i++) {
-		if (pi < 0) return NULL;
-		if (in_ptr_range(p, pi)) return &ptr_ranges[pi];
-		pi--;
-	}
-	return NULL;
+	return size_classes[slab_size_index].max_allocations;
 }
 
-static inline int get_slab_size_index_for_sz_log2(int sz_log2)
+static inline int get_allocation_index(int slab_size_index, int allocation_offset)
 {
-	int i = sz_log2 - ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2;
-	ASSERT(i >= 0);
-	ASSERT(i < NUM_SIZES);
-	return i;
+	return ((uint64_t)allocation_offset * size_classes[slab_size_index].recip) >> RECIP_SHIFT;
 }
 
-static inline int get_sz_log2_from_slab_size_index(int slab_size_index)
+static inline struct slab* get_slab(int slab_size_index, int slab_index)
 {
-	return slab_size_index + ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2;
+	struct slab* chunk = slab_sizes[slab_size_index].chunks[slab_index >> SLAB_CHUNK_LOG2];
+	if (chunk == NULL) return NULL;
+	return &chunk[slab_index & (SLAB_CHUNK_SIZE - 1)];
 }
 
-static inline int get_max_allocations_log2(int sz_log2)
+static inline int get_slab_index_for_ptr(void* p)
 {
-	return SLAB_SPACE_LOG2 - sz_log2;
+	return (((uint8_t*)p - slab_space) >> SLAB_SPACE_LOG2) & (MAX_SLABS_PER_ITEM_SIZE - 1);
 }
 
-static inline int get_max_allocations(int sz_log2)
+// returns NULL if the slab table doesn't reach p
+static inline struct slab* get_slab_for_ptr(void* p, int* slab_size_index)
 {
-	return 1 << get_max_allocations_log2(sz_log2);
+	size_t offset = (uint8_t*)p - slab_space;
+	int ssi = offset >> SLAB_SIZE_SPACE_LOG2;
+	if (slab_size_index != NULL) *slab_size_index = ssi;
+	return get_slab(ssi, get_slab_index_for_ptr(p));
 }
 
-static void* try_alloc(struct slab_size* ss, int slab_index, int sz_log2)
+static inline size_t get_freelist_size(int slab_size_index)
 {
-	ASSERT(slab_index >= 0);
-	ASSERT(slab_index < MAX_SLABS_PER_ITEM_SIZE);
-	struct slab* slab = &ss->slabs[slab_index];
+	size_t sz = (sizeof(freelist_t) * get_max_allocations(slab_size_index) + 7) & ~(size_t)7;
+#ifdef SLAB_DEBUG
+	sz += 2 * sizeof(uint64_t) * ((get_max_allocations(slab_size_index) + 63) / 64);
+#endif
+	return sz;
+}
 
-	if (slab->begin == NULL) return NULL;
+#ifdef SLAB_DEBUG
+static inline int get_poison_size(int slab_size_index)
+{
+	int item_size = get_item_size(slab_size_index);
+	return item_size < POISON_MAX ? item_size : POISON_MAX;
+}
 
-	ASSERT(sz_log2 >= ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2);
-	ASSERT(sz_log2 <= ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2);
+static void debug_alloc(void* p)
+{
+	int slab_size_index;
+	struct slab* slab = get_slab_for_ptr(p, &slab_size_index);
+	int i = get_allocation_index(slab_size_index, (uint8_t*)p - (uint8_t*)slab->begin);
+	uint64_t bit = (uint64_t)1 << (i & 63);
+	uint64_t was_live = __atomic_fetch_or(&slab->live[i >> 6], bit, __ATOMIC_RELAXED) & bit;
+	AZ(was_live);
+#ifdef SLAB_POISON
+	// the first word may have been used for the remote_frees link
+	if (__atomic_load_n(&slab->poisoned[i >> 6], __ATOMIC_RELAXED) & bit) {
+		uint64_t* w = p;
+		int n = get_poison_size(slab_size_index) / sizeof(*w);
+		for (int j = 1; j < n; j++) ASSERT(w[j] == POISON_WORD); // written to after free
+	}
+#endif
+}
 
-	int max_allocs_log2 = get_max_allocations_log2(sz_log2);
-	ASSERT(max_allocs_log2 >= (SLAB_SPACE_LOG2 - ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2));
-	ASSERT(max_allocs_log2 <= MAX_ALLOCS_PER_SLAB_LOG2);
-	int max_allocs = 1 << max_allocs_log2;
+static void debug_free(struct slab* slab, int slab_size_index, void* p)
+{
+	int i = get_allocation_index(slab_size_index, (uint8_t*)p - (uint8_t*)slab->begin);
+	uint64_t bit = (uint64_t)1 << (i & 63);
+	uint64_t was_live = __atomic_fetch_and(&slab->live[i >> 6], ~bit, __ATOMIC_RELAXED) & bit;
+	AN(was_live); // double free, or never allocated
+#ifdef SLAB_POISON
+	memset(p, POISON_BYTE, get_poison_size(slab_size_index));
+	__atomic_fetch_or(&slab->poisoned[i >> 6], bit, __ATOMIC_RELAXED);
+#endif
+}
+#else
+#define debug_alloc(p)
+#define debug_free(slab, slab_size_index, p)
+#endif
 
-	if (slab->n_allocated == max_allocs) return NULL;
+#define STAT_ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define STAT_INC(x) STAT_ADD(x, 1)
 
-	ASSERT(slab->n_allocated >= 0);
-	ASSERT(slab->n_allocated < max_allocs);
+static inline void stat_out_add(int slab_size_index, int n)
+{
+	struct slab_size* ss = &slab_sizes[slab_size_index];
+	size_t out = __atomic_add_fetch(&ss->n_out, n, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&ss->n_peak_out, __ATOMIC_RELAXED);
+	while (out > peak && !__atomic_compare_exchange_n(&ss->n_peak_out, &peak, out, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-	ss->last_used = slab_index;
-	return (uint8_t*)slab->begin + slab->freelist[slab->n_allocated++] * (1 << sz_log2);
+static inline void stat_out_sub(int slab_size_index, int n)
+{
+	__atomic_sub_fetch(&slab_sizes[slab_size_index].n_out, n, __ATOMIC_RELAXED);
 }
 
-static int new_slab(int slab_size_index)
+static inline int nonfull_summary_words(int n_words)
 {
-	struct slab_size* ss = &slab_sizes[slab_size_index];
-	if (ss->n_active_slabs == MAX_SLABS_PER_ITEM_SIZE) return -1;
-	ASSERT(ss->n_active_slabs < MAX_SLABS_PER_ITEM_SIZE);
-	ASSERT(ss->n_active_slabs >= 0);
+	return (n_words + 63) / 64;
+}
 
-	struct slab* slab = &ss->slabs[ss->n_active_slabs];
-	AZ(slab->begin);
-	AZ(slab->n_allocated);
-	AZ(slab->freelist);
+static void nonfull_grow(struct nonfull* nf, int word_index)
+{
+	int n_words = nf->n_words > 0 ? nf->n_words : NONFULL_MIN_WORDS;
+	while (n_words <= word_index) n_words *= 2;
+
+	uint64_t* words = mem_calloc(n_words * sizeof(*words));
+	uint64_t* summary = mem_calloc(nonfull_summary_words(n_words) * sizeof(*summary));
+	if (nf->n_words > 0) {
+		memcpy(words, nf->words, nf->n_words * sizeof(*words));
+		memcpy(summary, nf->summary, nonfull_summary_words(nf->n_words) * sizeof(*summary));
+		mem_free(nf->words);
+		mem_free(nf->summary);
+	}
+	nf->n_words = n_words;
+	nf->words = words;
+	nf->summary = summary;
+}
 
-	ASSERT(n_ptr_ranges < MAX_PTR_RANGES);
+static inline void set_nonfull(struct slab_thread_size* ts, int slab_index)
+{
+	struct nonfull* nf = &ts->nonfull;
+	int w = slab_index >> 6;
+	if (w >= nf->n_words) nonfull_grow(nf, w);
+	nf->words[w] |= (uint64_t)1 << (slab_index & 63);
+	nf->summary[w >> 6] |= (uint64_t)1 << (w & 63);
+}
 
-	slab->begin = mem_alloc(1 << SLAB_SPACE_LOG2);
-	AN(slab->begin);
+static inline void clear_nonfull(struct slab_thread_size* ts, int slab_index)
+{
+	struct nonfull* nf = &ts->nonfull;
+	int w = slab_index >> 6;
+	if (w >= nf->n_words) return;
+	nf->words[w] &= ~((uint64_t)1 << (slab_index & 63));
+	if (nf->words[w] == 0) nf->summary[w >> 6] &= ~((uint64_t)1 << (w & 63));
+}
 
-	int max_allocations = get_max_allocations(get_sz_log2_from_slab_size_index(slab_size_index));
-	slab->freelist = mem_alloc(sizeof(*slab->freelist) * max_allocations);
-	AN(slab->freelist);
-	for (int i = 0; i < max_allocations; i++) slab->freelist[i] = i;
+static inline int is_nonfull(struct slab_thread_size* ts, int slab_index)
+{
+	struct nonfull* nf = &ts->nonfull;
+	int w = slab_index >> 6;
+	if (w >= nf->n_words) return 0;
+	return (nf->words[w] >> (slab_index & 63)) & 1;
+}
 
-	struct ptr_range* pr;
-	int pridx = ptr_range_index_bin_search(slab->begin);
-	if (pridx == -1) {
-		AZ(n_ptr_ranges);
-		pr = &ptr_ranges[0];
-	} else {
-		if (ptr_ranges[pridx].p0 < slab->begin) pridx++;
-		int to_move = n_ptr_ranges - pridx;
-		if (to_move > 0) {
-			memmove(&ptr_ranges[pridx+1], &ptr_ranges[pridx], to_move * sizeof(*ptr_ranges));
-		}
-		pr = &ptr_ranges[pridx];
+// returns the lowest slab index in the set, or -1 if empty
+static inline int nonfull_first(struct nonfull* nf)
+{
+	int n = nonfull_summary_words(nf->n_words);
+	for (int i = 0; i < n; i++) {
+		if (nf->summary[i] == 0) continue;
+		int w = (i << 6) + __builtin_ctzll(nf->summary[i]);
+		return (w << 6) + __builtin_ctzll(nf->words[w]);
 	}
+	return -1;
+}
 
-	pr->p0 = slab->begin;
-	pr->slab_size_index = slab_size_index;
-	pr->slab_index = ss->n_active_slabs;
-
-	n_ptr_ranges++;
+// pops one allocation off the slab freelist; caller must own the slab
+static inline void* slab_get(struct slab_thread_size* ts, struct slab* slab, int item_size)
+{
+	if (slab->n_allocated == 0) ts->n_empty_slabs--;
+	return (uint8_t*)slab->begin + slab->freelist[slab->n_allocated++] * item_size;
+}
 
-	return ss->n_active_slabs++;
+// pushes an allocation back onto the slab freelist; caller must own the slab
+static inline void slab_put(struct slab_thread_size* ts, struct slab* slab, int slab_size_index, void* p)
+{
+	ASSERT(slab->n_allocated > 0);
+	if (slab->n_allocated == get_max_allocations(slab_size_index)) set_nonfull(ts, get_slab_index_for_ptr(slab->begin));
+	int allocation_index = get_allocation_index(slab_size_index, (uint8_t*)p - (uint8_t*)slab->begin);
+	slab->freelist[--slab->n_allocated] = allocation_index;
+	if (slab->n_allocated == 0) ts->n_empty_slabs++;
 }
 
-static int sz_log2_min(int sz_log2)
+static void slab_put_any(void* p)
 {
-	if (sz_log2 < ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2) sz_log2 = ITEM_SIZE_MALLOC_THRESHOLD_MIN_LOG2;
-	return sz_log2;
+	int slab_size_index;
+	struct slab* slab = get_slab_for_ptr(p, &slab_size_index);
+	slab_put(&slab->owner->sizes[slab_size_index], slab, slab_size_index, p);
 }
 
-#ifdef PARANOID
-static int freelist_index_count(struct slab* slab, int sz_log2, int allocation_index)
+// returns 1 if all slabs in slab_index' huge page group, except itself, are released
+static int huge_group_is_free(int slab_size_index, int slab_index)
 {
-	int max_allocations = get_max_allocations(sz_log2);
-	int count = 0;
-	for (int i = slab->n_allocated; i < max_allocations; i++) if (slab->freelist[i] == allocation_index) count++;
-	return count;
+	int first = slab_index & ~(HUGE_GROUP_SIZE - 1);
+	for (int i = first; i < first + HUGE_GROUP_SIZE; i++) {
+		if (i == slab_index) continue;
+		struct slab* slab = get_slab(slab_size_index, i);
+		if (slab != NULL && slab->begin != NULL) return 0;
+	}
+	return 1;
 }
-#endif
 
-int slab_can_alloc_log2(int sz_log2)
+static void release_slab_locked(int slab_size_index, int slab_index)
 {
-	ASSERT(sz_log2 >= 0);
-	if (sz_log2 > ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2) return 0;
+	struct slab_size* ss = &slab_sizes[slab_size_index];
+	struct slab* slab = get_slab(slab_size_index, slab_index);
+	AN(slab->begin);
+	AZ(slab->n_allocated);
 
-	sz_log2 = sz_log2_min(sz_log2);
+	if (huge_group_is_free(slab_size_index, slab_index)) {
+		// also covers group members committed along with this one
+		void* group = get_slab_begin(slab_size_index, slab_index & ~(HUGE_GROUP_SIZE - 1));
+		AZ(sys_vm_decommit(group, (size_t)HUGE_GROUP_SIZE << SLAB_SPACE_LOG2));
+	} else {
+		AZ(sys_vm_decommit(slab->begin, 1 << SLAB_SPACE_LOG2));
+	}
+	mem_free(slab->freelist);
+	memset(slab, 0, sizeof(*slab));
+	ss->n_slabs--;
+	ss->n_released_slabs++;
+
+	// shrink table past released slabs at the end
+	int n0 = ss->n_active_slabs;
+	int n = n0;
+	while (n > 0 && get_slab(slab_size_index, n-1)->begin == NULL) n--;
+	__atomic_store_n(&ss->n_active_slabs, n, __ATOMIC_RELEASE);
+
+	// chunks past the end only hold released slabs, so nobody can be looking
+	for (int i = (n + SLAB_CHUNK_SIZE - 1) >> SLAB_CHUNK_LOG2; i < (n0 + SLAB_CHUNK_SIZE - 1) >> SLAB_CHUNK_LOG2; i++) {
+		mem_free(ss->chunks[i]);
+		ss->chunks[i] = NULL;
+	}
+}
 
-	int slab_size_index = get_slab_size_index_for_sz_log2(sz_log2);
+// releases empty slabs owned by t until at most `retain` remain
+static void release_empty_slabs_locked(struct slab_thread* t, int slab_size_index, int retain)
+{
 	struct slab_size* ss = &slab_sizes[slab_size_index];
-	if (ss->n_active_slabs < MAX_SLABS_PER_ITEM_SIZE) return 1;
-
-	int max_allocations = get_max_allocations(sz_log2);
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
+	for (int i = ss->n_active_slabs - 1; i >= 0 && ts->n_empty_slabs > retain; i--) {
+		struct slab* slab = get_slab(slab_size_index, i);
+		if (slab == NULL) continue; // chunk freed by release_slab_locked()
+		if (slab->owner != t || slab->n_allocated > 0) continue;
+		release_slab_locked(slab_size_index, i);
+		clear_nonfull(ts, i);
+		ts->n_empty_slabs--;
+	}
+}
 
-	ASSERT(ss->last_used >= 0);
-	ASSERT(ss->last_used < MAX_SLABS_PER_ITEM_SIZE);
-	if (ss->slabs[ss->last_used].n_allocated < max_allocations) return 1;
+static void release_empty_slabs(struct slab_thread* t, int slab_size_index, int retain)
+{
+	if (t->sizes[slab_size_index].n_empty_slabs <= retain) return;
+	pthread_mutex_lock(&slab_lock);
+	release_empty_slabs_locked(t, slab_size_index, retain);
+	pthread_mutex_unlock(&slab_lock);
+}
 
-	for (int i = 0; i < ss->n_active_slabs; i++) {
-		if (ss->slabs[i].n_allocated < max_allocations) return 1;
-	}
+// pushes a list of allocations already linked from first to last
+static inline void remote_frees_push_list(void** stack, void* first, void* last)
+{
+	void* head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	do {
+		*(void**)last = head;
+	} while (!__atomic_compare_exchange_n(stack, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-	return 0;
+static inline void remote_frees_push(void** stack, void* p)
+{
+	remote_frees_push_list(stack, p, p);
 }
 
-void* slab_alloc_log2(int sz_log2)
+static inline void* remote_frees_take(void** stack)
 {
-	ASSERT(sz_log2 <= ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2);
+	if (__atomic_load_n(stack, __ATOMIC_RELAXED) == NULL) return NULL;
+	return __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE);
+}
 
-	sz_log2 = sz_log2_min(sz_log2);
-	int slab_size_index = get_slab_size_index_for_sz_log2(sz_log2);
-	struct slab_size* ss = &slab_sizes[slab_size_index];
-	ASSERT(ss->last_used >= 0);
-	ASSERT(ss->last_used < MAX_SLABS_PER_ITEM_SIZE);
+// returns collected remote frees to the magazine, and the slabs when it's full
+static int collect_remote_frees(struct slab_thread_size* ts, int slab_size_index)
+{
+	void* p = remote_frees_take(&ts->remote_frees);
+	int n = 0;
+	int n_put = 0;
+	while (p != NULL) {
+		void* next = *(void**)p;
+		if (ts->magazine.n < MAGAZINE_SIZE) {
+			ts->magazine.ptrs[ts->magazine.n++] = p;
+		} else {
+			slab_put_any(p);
+			n_put++;
+		}
+		p = next;
+		n++;
+	}
+	if (n_put > 0) stat_out_sub(slab_size_index, n_put);
+	return n;
+}
 
-	void* p = try_alloc(ss, ss->last_used, sz_log2);
-	if (p != NULL) return p;
+// returns the n oldest magazine entries to their slabs
+static void magazine_flush(struct slab_thread_size* ts, int slab_size_index, int n)
+{
+	struct magazine* mag = &ts->magazine;
+	ASSERT(n <= mag->n);
+	if (n == 0) return;
+	for (int i = 0; i < n; i++) slab_put_any(mag->ptrs[i]);
+	mag->n -= n;
+	memmove(&mag->ptrs[0], &mag->ptrs[n], mag->n * sizeof(*mag->ptrs));
+	stat_out_sub(slab_size_index, n);
+	STAT_INC(ts->n_flushes);
+}
 
-	for (int i = 0; i < ss->n_active_slabs; i++) {
-		p = try_alloc(ss, i, sz_log2);
-		if (p != NULL) return p;
+static void flush_thread(struct slab_thread* t)
+{
+	for (int i = 0; i < NUM_SIZES; i++) {
+		struct slab_thread_size* ts = &t->sizes[i];
+		collect_remote_frees(ts, i);
+		magazine_flush(ts, i, ts->magazine.n);
 	}
+}
 
-	int new_index = new_slab(slab_size_index);
-	ASSERT(new_index >= 0);
+static inline int get_retained_empty_slabs()
+{
+	return __atomic_load_n(&retained_empty_slabs, __ATOMIC_RELAXED);
+}
 
-	p = try_alloc(ss, new_index, sz_log2);
-	AN(p);
-	return p;
+static void release_thread_empty_slabs(struct slab_thread* t, int retain)
+{
+	for (int i = 0; i < NUM_SIZES; i++) release_empty_slabs(t, i, retain);
 }
 
-void* slab_calloc_log2(int sz_log2)
+static void detach_thread(void* arg)
 {
-	void* p = slab_alloc_log2(sz_log2);
-	memset(p, 0, 1 << sz_log2);
-	return p;
+	struct slab_thread* t = arg;
+	flush_thread(t);
+	release_thread_empty_slabs(t, get_retained_empty_slabs());
+	pthread_mutex_lock(&slab_lock);
+	t->alive = 0;
+	pthread_mutex_unlock(&slab_lock);
+	/* t may now go to another thread; slab use from a later TLS
+	 * destructor attaches again (and sets the key, so we run again) */
+	current_thread = NULL;
 }
 
-void slab_free(void* p)
+static void create_slab_thread_key()
 {
-	struct ptr_range* pr = ptr_range_bin_search(p);
-	AN(pr);
+	AZ(pthread_key_create(&slab_thread_key, detach_thread));
+}
 
-	struct slab* slab = &slab_sizes[pr->slab_size_index].slabs[pr->slab_index];
-	ASSERT(slab->n_allocated > 0);
+static struct slab_thread* attach_thread()
+{
+	pthread_once(&slab_thread_key_once, create_slab_thread_key);
+
+	pthread_mutex_lock(&slab_lock);
+	struct slab_thread* t = slab_threads;
+	while (t != NULL && t->alive) t = t->next;
+	if (t == NULL) {
+		t = mem_calloc(sizeof(*t));
+		t->next = slab_threads;
+		slab_threads = t;
+	}
+	t->alive = 1;
+	pthread_mutex_unlock(&slab_lock);
 
-	int allocation_offset = (uint8_t*)p - (uint8_t*)slab->begin;
-	int sz_log2 = get_sz_log2_from_slab_size_index(pr->slab_size_index);
-	int allocation_index = allocation_offset >> sz_log2;
-	ASSERT((allocation_index << sz_log2) == allocation_offset);
+	AZ(pthread_setspecific(slab_thread_key, t));
+	return t;
+}
 
-	slab->freelist[--slab->n_allocated] = allocation_index;
+static inline struct slab_thread* get_thread()
+{
+	if (current_thread == NULL) current_thread = attach_thread();
+	return current_thread;
+}
 
-	PARANOID_ASSERT(freelist_index_count(slab, sz_log2, allocation_index) == 1); // assertion is O(n)-expensive hence paranoid
+static inline int slab_is_full(struct slab* slab, int slab_size_index)
+{
+	return slab->n_allocated == get_max_allocations(slab_size_index);
 }
 
+static int find_owned_slab(struct slab_thread* t, int slab_size_index)
+{
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
 
+	ASSERT(ts->last_used >= 0);
+	ASSERT(ts->last_used < MAX_SLABS_PER_ITEM_SIZE);
+	if (is_nonfull(ts, ts->last_used)) return ts->last_used;
 
-#ifdef UNITTEST
+	return nonfull_first(&ts->nonfull);
+}
 
-static void count_active_slabs_and_allocated(int* n_active_slabs, int* n_allocated)
+static int new_slab(int slab_size_index, struct slab_thread* owner)
 {
-	if (n_active_slabs) *n_active_slabs = 0;
-	if (n_allocated) *n_allocated = 0;
-	for (int i = 0; i < NUM_SIZES; i++) {
-		struct slab_size* ss = &slab_sizes[i];
-		if (n_active_slabs) *n_active_slabs += ss->n_active_slabs;
-		for (int j = 0; j < ss->n_active_slabs; j++) {
-			if (n_allocated) *n_allocated += ss->slabs[j].n_allocated;
+	pthread_mutex_lock(&slab_lock);
+
+	struct slab_size* ss = &slab_sizes[slab_size_index];
+	if (ss->n_slabs == MAX_SLABS_PER_ITEM_SIZE) {
+		pthread_mutex_unlock(&slab_lock);
+		return -1;
+	}
+	ASSERT(ss->n_slabs < MAX_SLABS_PER_ITEM_SIZE);
+	ASSERT(ss->n_slabs >= 0);
+
+	// reuse a released slab if any, otherwise append
+	int slab_index = ss->n_active_slabs;
+	if (ss->n_slabs < ss->n_active_slabs) {
+		for (int i = 0; i < ss->n_active_slabs; i++) {
+			if (get_slab(slab_size_index, i)->begin == NULL) {
+				slab_index = i;
+				break;
+			}
 		}
 	}
-}
+	ASSERT(slab_index < MAX_SLABS_PER_ITEM_SIZE);
 
-static void test_functional()
-{
-	ASSERT(slab_sz_log2(1) == 1);
-	ASSERT(slab_sz_log2(2) == 1);
-	ASSERT(slab_sz_log2(3) == 2);
-	ASSERT(slab_sz_log2(16) == 4);
-	ASSERT(slab_sz_log2(20) == 5);
-	ASSERT(slab_sz_log2(30) == 5);
-	ASSERT(slab_sz_log2(32) == 5);
-	ASSERT(slab_sz_log2(40) == 6);
+	struct slab** chunk = &ss->chunks[slab_index >> SLAB_CHUNK_LOG2];
+	if (*chunk == NULL) *chunk = mem_calloc(sizeof(**chunk) << SLAB_CHUNK_LOG2);
+	struct slab* slab = get_slab(slab_size_index, slab_index);
+	AZ(slab->begin);
+	AZ(slab->n_allocated);
+	AZ(slab->freelist);
 
-	ASSERT(get_slab_size_index_for_sz_log2(4) == 0);
-	ASSERT(get_slab_size_index_for_sz_log2(5) == 1);
-	ASSERT(get_slab_size_index_for_sz_log2(6) == 2);
+	if (slab_space == NULL) {
+		AN(slab_space = sys_vm_reserve(SLAB_TOTAL_SPACE, SLAB_SPACE_ALIGN_LOG2));
+	}
+
+	slab->begin = get_slab_begin(slab_size_index, slab_index);
+	if (huge_pages && huge_group_is_free(slab_size_index, slab_index)) {
+		void* group = get_slab_begin(slab_size_index, slab_index & ~(HUGE_GROUP_SIZE - 1));
+		size_t group_sz = (size_t)HUGE_GROUP_SIZE << SLAB_SPACE_LOG2;
+		AZ(sys_vm_commit(group, group_sz));
+		sys_vm_advise_huge(group, group_sz, 1);
+	} else {
+		AZ(sys_vm_commit(slab->begin, 1 << SLAB_SPACE_LOG2));
+	}
+
+	int max_allocations = get_max_allocations(slab_size_index);
+	size_t freelist_size = get_freelist_size(slab_size_index);
+	slab->freelist = mem_alloc(freelist_size);
+	AN(slab->freelist);
+	for (int i = 0; i < max_allocations; i++) slab->freelist[i] = i;
+#ifdef SLAB_DEBUG
+	int n_words = (max_allocations + 63) / 64;
+	slab->live = (uint64_t*)((uint8_t*)slab->freelist + freelist_size) - 2 * n_words;
+	slab->poisoned = slab->live + n_words;
+	memset(slab->live, 0, 2 * n_words * sizeof(uint64_t));
+#endif
 
-	ASSERT(get_sz_log2_from_slab_size_index(0) == 4);
-	ASSERT(get_sz_log2_from_slab_size_index(1) == 5);
-	ASSERT(get_sz_log2_from_slab_size_index(2) == 6);
+	slab->owner = owner;
+	owner->sizes[slab_size_index].n_empty_slabs++;
+	set_nonfull(&owner->sizes[slab_size_index], slab_index);
 
-	ASSERT(get_max_allocations_log2(4) == 16);
-	ASSERT(get_max_allocations_log2(5) == 15);
-	ASSERT(get_max_allocations_log2(6) == 14);
+	ss->n_slabs++;
+	ss->n_new_slabs++;
+	if (slab_index == ss->n_active_slabs) {
+		__atomic_store_n(&ss->n_active_slabs, slab_index + 1, __ATOMIC_RELEASE);
+	}
 
-	ASSERT(get_max_allocations(4) == (1 <<16));
-	ASSERT(get_max_allocations(5) == (1 <<15));
-	ASSERT(get_max_allocations(6) == (1 <<14));
+	pthread_mutex_unlock(&slab_lock);
 
-	ASSERT(sz_log2_min(0) == 4);
-	ASSERT(sz_log2_min(2) == 4);
-	ASSERT(sz_log2_min(4) == 4);
-	ASSERT(sz_log2_min(5) == 5);
+	return slab_index;
 }
 
-static void test_can_alloc()
+// returns a slab with room owned by t, or -1 if the size is exhausted
+static int get_owned_slab(struct slab_thread* t, int slab_size_index)
 {
-	AN(slab_can_alloc(4));
-	AN(slab_can_alloc(100));
-	AN(slab_can_alloc(65536));
-	AZ(slab_can_alloc(65536+1));
-	AZ(slab_can_alloc(100000));
+	int slab_index = find_owned_slab(t, slab_size_index);
+	if (slab_index == -1) slab_index = new_slab(slab_size_index, t);
+	return slab_index;
 }
 
-static void test_can_alloc_at_limit()
+// refills an empty magazine; returns 0 if the size is exhausted
+static int magazine_refill(struct slab_thread* t, int slab_size_index)
 {
-	int sz_log2 = 16;
-	int n = MAX_SLABS_PER_ITEM_SIZE << (SLAB_SPACE_LOG2 - sz_log2);
-	void* ptrs[n];
-	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc_log2(sz_log2);
-	ASSERT(ut_allocations == 512);
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
+	AZ(ts->magazine.n);
+
+	STAT_INC(ts->n_refills);
+	if (collect_remote_frees(ts, slab_size_index) > 0) return 1;
+
+	int slab_index = get_owned_slab(t, slab_size_index);
+	if (slab_index == -1) return 0;
+
+	struct slab* slab = get_slab(slab_size_index, slab_index);
+	int item_size = get_item_size(slab_size_index);
+	int n = get_max_allocations(slab_size_index) - slab->n_allocated;
+	if (n > MAGAZINE_BATCH) n = MAGAZINE_BATCH;
+	ASSERT(n > 0);
+	for (int i = n - 1; i >= 0; i--) ts->magazine.ptrs[i] = slab_get(ts, slab, item_size);
+	if (slab_is_full(slab, slab_size_index)) clear_nonfull(ts, slab_index);
+	stat_out_add(slab_size_index, n);
+	ts->magazine.n = n;
+	ts->last_used = slab_index;
+
+	return 1;
+}
 
-	AZ(slab_can_alloc_log2(sz_log2));
-	slab_free(ptrs[n-1]);
-	AN(slab_can_alloc_log2(sz_log2));
-	ptrs[n-1] = slab_alloc_log2(sz_log2);
-	AZ(slab_can_alloc_log2(sz_log2));
-	slab_free(ptrs[0]);
-	AN(slab_can_alloc_log2(sz_log2));
-	ptrs[0] = slab_alloc_log2(sz_log2);
-	AZ(slab_can_alloc_log2(sz_log2));
-	slab_free(ptrs[n/2]);
-	AN(slab_can_alloc_log2(sz_log2));
+static int can_alloc(int slab_size_index)
+{
+	struct slab_thread* t = get_thread();
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
+	if (ts->magazine.n > 0) return 1;
+	if (__atomic_load_n(&ts->remote_frees, __ATOMIC_RELAXED) != NULL) return 1;
+	if (__atomic_load_n(&slab_sizes[slab_size_index].n_slabs, __ATOMIC_RELAXED) < MAX_SLABS_PER_ITEM_SIZE) return 1;
+	if (find_owned_slab(t, slab_size_index) >= 0) return 1;
+	return 0;
 }
 
-static void test_simple_allocations()
+static inline void* alloc(int slab_size_index)
 {
-	void* p = slab_alloc(10);
-	AN(p);
-	slab_free(p);
+	struct slab_thread_size* ts = &get_thread()->sizes[slab_size_index];
 
-	void* p2 = slab_alloc(10);
-	ASSERT(p == p2);
-	slab_free(p2);
+	if (ts->magazine.n == 0) {
+		int refilled = magazine_refill(current_thread, slab_size_index);
+		AN(refilled);
+	}
 
-	void* p3 = slab_alloc(40);
-	ASSERT(p != p3);
-	slab_free(p3);
+	STAT_INC(ts->n_allocs);
+	void* p = ts->magazine.ptrs[--ts->magazine.n];
+	debug_alloc(p);
+	return p;
+}
 
-	int n_active_slabs, n_allocated;
-	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
-	ASSERT(n_active_slabs == 2);
-	AZ(n_allocated);
+/* empties the magazine first, then takes whole runs straight off the slab
+ * freelists; the magazine is only refilled for the last few */
+static void alloc_many(int slab_size_index, void** ptrs, int n)
+{
+	struct slab_thread* t = get_thread();
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
+	struct magazine* mag = &ts->magazine;
+	int item_size = get_item_size(slab_size_index);
+	STAT_ADD(ts->n_allocs, n);
+
+#ifdef SLAB_DEBUG
+	void** ptrs0 = ptrs;
+	int n0 = n;
+#endif
+	while (n > 0) {
+		if (mag->n == 0 && (n < MAGAZINE_BATCH || __atomic_load_n(&ts->remote_frees, __ATOMIC_RELAXED) != NULL)) {
+			AN(magazine_refill(t, slab_size_index));
+		}
 
-	ASSERT(ut_allocations == 4); // 2 per slab
-	ASSERT(ut_frees == 0);
+		if (mag->n > 0) {
+			int m = mag->n < n ? mag->n : n;
+			for (int i = 0; i < m; i++) ptrs[i] = mag->ptrs[--mag->n];
+			ptrs += m;
+			n -= m;
+			continue;
+		}
+
+		int slab_index = get_owned_slab(t, slab_size_index);
+		ASSERT(slab_index >= 0);
+		struct slab* slab = get_slab(slab_size_index, slab_index);
+		int m = get_max_allocations(slab_size_index) - slab->n_allocated;
+		if (m > n) m = n;
+		for (int i = 0; i < m; i++) ptrs[i] = slab_get(ts, slab, item_size);
+		if (slab_is_full(slab, slab_size_index)) clear_nonfull(ts, slab_index);
+		stat_out_add(slab_size_index, m);
+		ts->last_used = slab_index;
+		ptrs += m;
+		n -= m;
+	}
+#ifdef SLAB_DEBUG
+	for (int i = 0; i < n0; i++) debug_alloc(ptrs0[i]);
+#endif
 }
 
-static void test_using_multiple_slabs_per_size()
+static inline int is_large(size_t sz)
 {
-	int sz_log2 = 5;
-	int n = get_max_allocations(sz_log2);
-	for (int i = 0; i < n; i++) slab_alloc(1 << sz_log2);
+	return sz > ITEM_SIZE_MALLOC_THRESHOLD_MAX;
+}
 
-	int n_active_slabs, n_allocated;
-	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
-	ASSERT(n_active_slabs == 1);
-	ASSERT(n_allocated == n);
+static inline int is_large_log2(int sz_log2)
+{
+	ASSERT(sz_log2 >= 0);
+	ASSERT(sz_log2 < (int)(sizeof(size_t) * 8) - 1);
+	return sz_log2 > ITEM_SIZE_MALLOC_THRESHOLD_MAX_LOG2;
+}
 
-	slab_alloc(1 << sz_log2);
-	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
-	ASSERT(n_active_slabs == 2);
-	ASSERT(n_allocated == n+1);
+// large allocations are fresh mappings, and thus zeroed
+static void* large_alloc(size_t sz)
+{
+	ASSERT(sz <= SIZE_MAX - LARGE_HEADER_SIZE - LARGE_PAGE_SIZE);
+	size_t map_sz = (sz + LARGE_HEADER_SIZE + LARGE_PAGE_SIZE - 1) & ~(size_t)(LARGE_PAGE_SIZE - 1);
+	struct large_header* h = sys_vm_map(map_sz);
+	AN(h);
+	h->map_sz = map_sz;
+	h->magic = LARGE_MAGIC ^ (uintptr_t)h;
+
+	__atomic_add_fetch(&n_large_live, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bytes_large, map_sz, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&n_large_allocs, 1, __ATOMIC_RELAXED);
+	return (uint8_t*)h + LARGE_HEADER_SIZE;
 }
 
-static void test_freeing_stuff()
+static void large_free(void* p)
 {
-	int sz_log2 = 10;
-	int sz = 1 << sz_log2;
-	int n = get_max_allocations(sz_log2);
-	void* ptrs[n];
-	for (int i = 0; i < n; i++) {
-		ptrs[i] = slab_alloc(sz);
-	}
+	ASSERT(((uintptr_t)p & (LARGE_PAGE_SIZE - 1)) == LARGE_HEADER_SIZE); // pointer not from slab_alloc*()
+	struct large_header* h = (struct large_header*)((uint8_t*)p - LARGE_HEADER_SIZE);
+	ASSERT(h->magic == (LARGE_MAGIC ^ (uintptr_t)h));
+	size_t map_sz = h->map_sz;
+	h->magic = 0;
+	sys_vm_release(h, map_sz);
+
+	__atomic_sub_fetch(&n_large_live, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&bytes_large, map_sz, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&n_large_frees, 1, __ATOMIC_RELAXED);
+}
 
-	for (int i = 0; i < n; i++) {
-		if (i&1) slab_free(ptrs[i]);
+int slab_can_alloc(size_t sz)
+{
+	if (is_large(sz)) return 1;
+	return can_alloc(get_slab_size_index(sz));
+}
+
+int slab_can_alloc_log2(int sz_log2)
+{
+	if (is_large_log2(sz_log2)) return 1;
+	return can_alloc(get_slab_size_index_for_sz_log2(sz_log2));
+}
+
+void* slab_alloc(size_t sz)
+{
+	n_thread_allocs++;
+	void* p = is_large(sz) ? large_alloc(sz) : alloc(get_slab_size_index(sz));
+	ALLOC_TRACE_EVENT(ALLOC, SLAB, p, NULL, sz);
+	return p;
+}
+
+void* slab_alloc_log2(int sz_log2)
+{
+	n_thread_allocs++;
+	void* p = is_large_log2(sz_log2) ? large_alloc((size_t)1 << sz_log2) : alloc(get_slab_size_index_for_sz_log2(sz_log2));
+	ALLOC_TRACE_EVENT(ALLOC, SLAB, p, NULL, (size_t)1 << sz_log2);
+	return p;
+}
+
+void* slab_alloc_class(int size_class)
+{
+	ASSERT(size_class >= 0 && size_class < NUM_SIZES);
+	n_thread_allocs++;
+	void* p = alloc(size_class);
+	ALLOC_TRACE_EVENT(ALLOC, SLAB, p, NULL, get_item_size(size_class));
+	return p;
+}
+
+void* slab_calloc(size_t sz)
+{
+	void* p = slab_alloc(sz);
+	if (!is_large(sz)) memset(p, 0, sz);
+	return p;
+}
+
+void* slab_calloc_log2(int sz_log2)
+{
+	void* p = slab_alloc_log2(sz_log2);
+	if (!is_large_log2(sz_log2)) memset(p, 0, 1 << sz_log2);
+	return p;
+}
+
+void slab_alloc_many(size_t sz, void** ptrs, int n)
+{
+	ASSERT(n >= 0);
+	n_thread_allocs += n;
+	if (is_large(sz)) {
+		for (int i = 0; i < n; i++) ptrs[i] = large_alloc(sz);
+	} else {
+		alloc_many(get_slab_size_index(sz), ptrs, n);
+	}
+#ifdef ALLOC_TRACE
+	for (int i = 0; i < n; i++) ALLOC_TRACE_EVENT(ALLOC, SLAB, ptrs[i], NULL, sz);
+#endif
+}
+
+void slab_alloc_many_log2(int sz_log2, void** ptrs, int n)
+{
+	ASSERT(n >= 0);
+	n_thread_allocs += n;
+	if (is_large_log2(sz_log2)) {
+		for (int i = 0; i < n; i++) ptrs[i] = large_alloc((size_t)1 << sz_log2);
+	} else {
+		alloc_many(get_slab_size_index_for_sz_log2(sz_log2), ptrs, n);
+	}
+#ifdef ALLOC_TRACE
+	for (int i = 0; i < n; i++) ALLOC_TRACE_EVENT(ALLOC, SLAB, ptrs[i], NULL, (size_t)1 << sz_log2);
+#endif
+}
+
+void slab_alloc_many_class(int size_class, void** ptrs, int n)
+{
+	ASSERT(size_class >= 0 && size_class < NUM_SIZES);
+	ASSERT(n >= 0);
+	n_thread_allocs += n;
+	alloc_many(size_class, ptrs, n);
+#ifdef ALLOC_TRACE
+	for (int i = 0; i < n; i++) ALLOC_TRACE_EVENT(ALLOC, SLAB, ptrs[i], NULL, get_item_size(size_class));
+#endif
+}
+
+static inline int is_in_slab(struct slab* slab, void* p)
+{
+	return (size_t)((uint8_t*)p - (uint8_t*)slab->begin) < (1 << SLAB_SPACE_LOG2);
+}
+
+// asserts that p points at the start of an allocation in its slab
+static inline void check_allocation(struct slab* slab, int slab_size_index, void* p)
+{
+	int allocation_offset = (uint8_t*)p - (uint8_t*)slab->begin;
+	int allocation_index = get_allocation_index(slab_size_index, allocation_offset);
+	ASSERT(allocation_index * get_item_size(slab_size_index) == allocation_offset);
+}
+
+// returns the slab p was allocated from, or NULL if p is a large allocation
+static inline struct slab* lookup_slab(void* p, int* slab_size_index)
+{
+	size_t offset = (uint8_t*)p - slab_space;
+	if (slab_space == NULL || offset >= SLAB_TOTAL_SPACE) return NULL;
+	struct slab* slab = get_slab_for_ptr(p, slab_size_index);
+	ASSERT(slab != NULL && slab->begin != NULL);
+	check_allocation(slab, *slab_size_index, p);
+	return slab;
+}
+
+void slab_free(void* p)
+{
+	// traced before the slot can be reused by another thread
+	ALLOC_TRACE_EVENT(FREE, SLAB, p, NULL, 0);
+	int slab_size_index;
+	struct slab* slab = lookup_slab(p, &slab_size_index);
+	if (slab == NULL) {
+		large_free(p);
+		return;
+	}
+	debug_free(slab, slab_size_index, p);
+
+	struct slab_thread* t = get_thread();
+	struct slab_thread_size* ts = &t->sizes[slab_size_index];
+	STAT_INC(ts->n_frees);
+	if (slab->owner != t) {
+		STAT_INC(ts->n_remote_frees);
+		remote_frees_push(&slab->owner->sizes[slab_size_index].remote_frees, p);
+		return;
+	}
+
+	ASSERT(slab->n_allocated > 0);
+	struct magazine* mag = &ts->magazine;
+	if (mag->n == MAGAZINE_SIZE) {
+		magazine_flush(ts, slab_size_index, MAGAZINE_BATCH);
+		release_empty_slabs(t, slab_size_index, get_retained_empty_slabs());
+	}
+	mag->ptrs[mag->n++] = p;
+}
+
+/* runs of pointers into the same slab are looked up once; local runs go
+ * straight back onto the slab freelist, remote runs are pushed onto the
+ * owner's remote_frees as one list */
+void slab_free_many(void** ptrs, int n)
+{
+	ASSERT(n >= 0);
+#ifdef ALLOC_TRACE
+	for (int i = 0; i < n; i++) ALLOC_TRACE_EVENT(FREE, SLAB, ptrs[i], NULL, 0);
+#endif
+	struct slab_thread* t = get_thread();
+	uint64_t touched = 0; // bit per size
+
+	int i = 0;
+	while (i < n) {
+		int slab_size_index;
+		struct slab* slab = lookup_slab(ptrs[i], &slab_size_index);
+		if (slab == NULL) {
+			large_free(ptrs[i++]);
+			continue;
+		}
+		int j = i + 1;
+		while (j < n && is_in_slab(slab, ptrs[j])) check_allocation(slab, slab_size_index, ptrs[j++]);
+#ifdef SLAB_DEBUG
+		for (int k = i; k < j; k++) debug_free(slab, slab_size_index, ptrs[k]);
+#endif
+
+		struct slab_thread_size* ts = &t->sizes[slab_size_index];
+		STAT_ADD(ts->n_frees, j - i);
+		if (slab->owner == t) {
+			for (int k = i; k < j; k++) slab_put(ts, slab, slab_size_index, ptrs[k]);
+			stat_out_sub(slab_size_index, j - i);
+			touched |= (uint64_t)1 << slab_size_index;
+		} else {
+			STAT_ADD(ts->n_remote_frees, j - i);
+			for (int k = i; k < j - 1; k++) *(void**)ptrs[k] = ptrs[k+1];
+			remote_frees_push_list(&slab->owner->sizes[slab_size_index].remote_frees, ptrs[i], ptrs[j-1]);
+		}
+		i = j;
+	}
+
+	while (touched) {
+		int slab_size_index = __builtin_ctzll(touched);
+		touched &= touched - 1;
+		release_empty_slabs(t, slab_size_index, get_retained_empty_slabs());
+	}
+}
+
+uint64_t slab_thread_allocs()
+{
+	return n_thread_allocs;
+}
+
+void slab_thread_flush()
+{
+	if (current_thread == NULL) return;
+	flush_thread(current_thread);
+	release_thread_empty_slabs(current_thread, get_retained_empty_slabs());
+}
+
+void slab_set_retained_empty_slabs(int n)
+{
+	ASSERT(n >= 0);
+	__atomic_store_n(&retained_empty_slabs, n, __ATOMIC_RELAXED);
+}
+
+int slab_set_huge_pages(int enable)
+{
+	static int supported = -1;
+	pthread_mutex_lock(&slab_lock);
+	if (enable && supported == -1) {
+		// probe on a scratch reservation; slab groups are advised as they're committed
+		size_t sz = (size_t)1 << SYS_VM_HUGE_PAGE_LOG2;
+		void* p = sys_vm_reserve(sz, SYS_VM_HUGE_PAGE_LOG2);
+		AN(p);
+		supported = sys_vm_advise_huge(p, sz, 1) == 0;
+		sys_vm_release(p, sz);
+	}
+	huge_pages = enable && supported;
+	pthread_mutex_unlock(&slab_lock);
+	return enable && !supported ? -1 : 0;
+}
+
+void slab_get_stats(struct slab_stats* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&slab_lock);
+	for (int i = 0; i < NUM_SIZES; i++) {
+		struct slab_size* ss = &slab_sizes[i];
+		struct slab_size_stats* st = &stats->sizes[i];
+		st->item_size = get_item_size(i);
+		st->n_slabs = ss->n_slabs;
+		st->n_peak = __atomic_load_n(&ss->n_peak_out, __ATOMIC_RELAXED);
+		st->n_new_slabs = ss->n_new_slabs;
+		st->n_released_slabs = ss->n_released_slabs;
+		for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) {
+			struct slab_thread_size* ts = &t->sizes[i];
+			st->n_allocs += __atomic_load_n(&ts->n_allocs, __ATOMIC_RELAXED);
+			st->n_frees += __atomic_load_n(&ts->n_frees, __ATOMIC_RELAXED);
+			st->n_remote_frees += __atomic_load_n(&ts->n_remote_frees, __ATOMIC_RELAXED);
+			st->n_refills += __atomic_load_n(&ts->n_refills, __ATOMIC_RELAXED);
+			st->n_flushes += __atomic_load_n(&ts->n_flushes, __ATOMIC_RELAXED);
+		}
+		// counters are read one by one, so frees may be seen before their allocs
+		st->n_live = st->n_allocs > st->n_frees ? st->n_allocs - st->n_frees : 0;
+		st->bytes_reserved = (size_t)st->n_slabs << SLAB_SPACE_LOG2;
+		st->bytes_used = st->n_live * st->item_size;
+
+		stats->n_live += st->n_live;
+		stats->n_slabs += st->n_slabs;
+		stats->bytes_reserved += st->bytes_reserved;
+		stats->bytes_used += st->bytes_used;
+	}
+	pthread_mutex_unlock(&slab_lock);
+
+	stats->n_large = __atomic_load_n(&n_large_live, __ATOMIC_RELAXED);
+	stats->bytes_large = __atomic_load_n(&bytes_large, __ATOMIC_RELAXED);
+	stats->n_large_allocs = __atomic_load_n(&n_large_allocs, __ATOMIC_RELAXED);
+	stats->n_large_frees = __atomic_load_n(&n_large_frees, __ATOMIC_RELAXED);
+}
+
+void slab_dump_stats()
+{
+	struct slab_stats stats;
+	slab_get_stats(&stats);
+
+	fprintf(stderr, "slab stats: %zu live, %zu slabs, %.1f/%.1f MiB used/reserved\n",
+		stats.n_live,
+		stats.n_slabs,
+		stats.bytes_used / 1048576.0,
+		stats.bytes_reserved / 1048576.0);
+	fprintf(stderr, "large: %zu live, %.1f MiB mapped, %llu allocs, %llu frees\n",
+		stats.n_large,
+		stats.bytes_large / 1048576.0,
+		(unsigned long long)stats.n_large_allocs,
+		(unsigned long long)stats.n_large_frees);
+	fprintf(stderr, "%8s %10s %10s %6s %8s %12s %12s %10s %10s %8s\n",
+		"size", "live", "peak", "slabs", "use%", "allocs", "frees", "remote", "refills", "new");
+	for (int i = 0; i < SLAB_NUM_SIZES; i++) {
+		struct slab_size_stats* st = &stats.sizes[i];
+		if (st->n_allocs == 0 && st->n_slabs == 0) continue;
+		fprintf(stderr, "%8zu %10zu %10zu %6zu %7.1f%% %12llu %12llu %10llu %10llu %8llu\n",
+			st->item_size,
+			st->n_live,
+			st->n_peak,
+			st->n_slabs,
+			st->bytes_reserved ? 100.0 * st->bytes_used / st->bytes_reserved : 0.0,
+			(unsigned long long)st->n_allocs,
+			(unsigned long long)st->n_frees,
+			(unsigned long long)st->n_remote_frees,
+			(unsigned long long)st->n_refills,
+			(unsigned long long)st->n_new_slabs);
+	}
+}
+
+void slab_trim()
+{
+	if (current_thread != NULL) {
+		flush_thread(current_thread);
+		release_thread_empty_slabs(current_thread, 0);
+	}
+
+	/* slabs of exited threads are not touched by anyone until the
+	 * slab_thread is handed over in attach_thread(), which takes the lock */
+	pthread_mutex_lock(&slab_lock);
+	for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) {
+		if (t->alive) continue;
+		flush_thread(t);
+		for (int i = 0; i < NUM_SIZES; i++) release_empty_slabs_locked(t, i, 0);
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
+
+
+
+#ifdef UNITTEST
+
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static void flush_all_threads()
+{
+	// only safe when no other thread is allocating
+	for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) flush_thread(t);
+}
+
+static void nonfull_free(struct nonfull* nf)
+{
+	if (nf->n_words == 0) return;
+	mem_free(nf->words);
+	mem_free(nf->summary);
+	memset(nf, 0, sizeof(*nf));
+}
+
+static void check_nonfull_bitmaps()
+{
+	for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) {
+		for (int i = 0; i < NUM_SIZES; i++) {
+			struct nonfull* nf = &t->sizes[i].nonfull;
+			for (int j = 0; j < MAX_SLABS_PER_ITEM_SIZE; j++) {
+				struct slab* slab = get_slab(i, j);
+				int nonfull = slab != NULL && slab->begin != NULL && slab->owner == t && !slab_is_full(slab, i);
+				ASSERT(is_nonfull(&t->sizes[i], j) == nonfull);
+			}
+			for (int w = 0; w < nf->n_words; w++) {
+				ASSERT(((nf->summary[w >> 6] >> (w & 63)) & 1) == (nf->words[w] != 0));
+			}
+		}
+	}
+}
+
+static void count_active_slabs_and_allocated(int* n_active_slabs, int* n_allocated)
+{
+	flush_all_threads();
+	if (n_active_slabs) *n_active_slabs = 0;
+	if (n_allocated) *n_allocated = 0;
+	for (int i = 0; i < NUM_SIZES; i++) {
+		struct slab_size* ss = &slab_sizes[i];
+		if (n_active_slabs) *n_active_slabs += ss->n_active_slabs;
+		for (int j = 0; j < ss->n_active_slabs; j++) {
+			if (n_allocated) *n_allocated += get_slab(i, j)->n_allocated;
+		}
+	}
+}
+
+static void test_functional()
+{
+	ASSERT(slab_sz_log2(1) == 1);
+	ASSERT(slab_sz_log2(2) == 1);
+	ASSERT(slab_sz_log2(3) == 2);
+	ASSERT(slab_sz_log2(16) == 4);
+	ASSERT(slab_sz_log2(20) == 5);
+	ASSERT(slab_sz_log2(30) == 5);
+	ASSERT(slab_sz_log2(32) == 5);
+	ASSERT(slab_sz_log2(40) == 6);
+
+	ASSERT(get_slab_size_index_for_sz_log2(0) == 0);
+	ASSERT(get_slab_size_index_for_sz_log2(2) == 0);
+	ASSERT(get_slab_size_index_for_sz_log2(4) == 0);
+	ASSERT(get_slab_size_index_for_sz_log2(5) == 1);
+	ASSERT(get_slab_size_index_for_sz_log2(6) == 3);
+	ASSERT(get_slab_size_index_for_sz_log2(7) == 7);
+	ASSERT(get_slab_size_index_for_sz_log2(16) == NUM_SIZES - 1);
+
+	ASSERT(get_slab_size_index(1) == 0);
+	ASSERT(get_slab_size_index(16) == 0);
+	ASSERT(get_slab_size_index(17) == 1);
+	ASSERT(get_slab_size_index(64) == 3);
+	ASSERT(get_slab_size_index(65) == 4);
+	ASSERT(get_item_size(get_slab_size_index(65)) == 80);
+	ASSERT(get_item_size(get_slab_size_index(33 << 10)) == 40 << 10);
+
+	ASSERT(get_max_allocations(0) == (1 <<16));
+	ASSERT(get_max_allocations(1) == (1 <<15));
+	ASSERT(get_max_allocations(get_slab_size_index(80)) == (1 << 20) / 80);
+
+	// every size maps to the smallest class that fits it (covers both the
+	// lookup table and the computed classes)
+	for (int sz = 1; sz <= ITEM_SIZE_MALLOC_THRESHOLD_MAX; sz++) {
+		int i = get_slab_size_index(sz);
+		ASSERT(i >= 0 && i < NUM_SIZES);
+		ASSERT(get_item_size(i) >= sz);
+		ASSERT(i == 0 || get_item_size(i-1) < sz);
+		ASSERT(slab_size_class(sz) == i);
+	}
+
+	// reciprocal division is exact for every slot in a slab
+	for (int i = 0; i < NUM_SIZES; i++) {
+		int item_size = get_item_size(i);
+		ASSERT((item_size & 15) == 0);
+		for (int j = 0; j < get_max_allocations(i); j++) {
+			ASSERT(get_allocation_index(i, j * item_size) == j);
+			ASSERT(get_allocation_index(i, j * item_size + item_size - 1) == j);
+		}
+	}
+}
+
+static void test_can_alloc()
+{
+	AN(slab_can_alloc(4));
+	AN(slab_can_alloc(100));
+	AN(slab_can_alloc(65536));
+	AN(slab_can_alloc(65536+1));
+	AN(slab_can_alloc(100000));
+	AN(slab_can_alloc_log2(30));
+}
+
+static void test_can_alloc_at_limit()
+{
+	int sz_log2 = 16;
+	int n = MAX_SLABS_PER_ITEM_SIZE << (SLAB_SPACE_LOG2 - sz_log2);
+	void* ptrs[n];
+	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc_log2(sz_log2);
+	ASSERT(slab_sizes[get_slab_size_index_for_sz_log2(sz_log2)].n_slabs == MAX_SLABS_PER_ITEM_SIZE);
+	// freelists + chunks + slab_thread + nonfull bitmap (grown 4 -> 8 words)
+	ASSERT(ut_allocations == MAX_SLABS_PER_ITEM_SIZE + MAX_SLAB_CHUNKS + 1 + 2*2);
+	ASSERT(ut_frees == 2);
+
+	AZ(slab_can_alloc_log2(sz_log2));
+	slab_free(ptrs[n-1]);
+	AN(slab_can_alloc_log2(sz_log2));
+	ptrs[n-1] = slab_alloc_log2(sz_log2);
+	AZ(slab_can_alloc_log2(sz_log2));
+	slab_free(ptrs[0]);
+	AN(slab_can_alloc_log2(sz_log2));
+	ptrs[0] = slab_alloc_log2(sz_log2);
+	AZ(slab_can_alloc_log2(sz_log2));
+	slab_free(ptrs[n/2]);
+	AN(slab_can_alloc_log2(sz_log2));
+}
+
+static void test_simple_allocations()
+{
+	void* p = slab_alloc(10);
+	AN(p);
+	slab_free(p);
+
+	void* p2 = slab_alloc(10);
+	ASSERT(p == p2);
+	slab_free(p2);
+
+	void* p3 = slab_alloc(40);
+	ASSERT(p != p3);
+	slab_free(p3);
+
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 2);
+	AZ(n_allocated);
+
+	ASSERT(ut_allocations == 9); // per size: freelist, table chunk, nonfull words+summary; + 1 slab_thread. slab memory itself is reserved/committed in slab_space
+	ASSERT(ut_frees == 0);
+}
+
+static void test_using_multiple_slabs_per_size()
+{
+	int sz_log2 = 5;
+	int n = get_max_allocations(get_slab_size_index_for_sz_log2(sz_log2));
+	for (int i = 0; i < n; i++) slab_alloc(1 << sz_log2);
+
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 1);
+	ASSERT(n_allocated == n);
+
+	slab_alloc(1 << sz_log2);
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 2);
+	ASSERT(n_allocated == n+1);
+}
+
+static void test_freeing_stuff()
+{
+	int sz_log2 = 10;
+	int sz = 1 << sz_log2;
+	int n = get_max_allocations(get_slab_size_index_for_sz_log2(sz_log2));
+	void* ptrs[n];
+	for (int i = 0; i < n; i++) {
+		ptrs[i] = slab_alloc(sz);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (i&1) slab_free(ptrs[i]);
 	}
 
 	int n_active_slabs, n_allocated;
@@ -438,32 +1405,747 @@ static void test_freeing_multiple_sizes()
 	ASSERT(n_allocated == 0);
 }
 
+static void* remote_free_worker(void* arg)
+{
+	void** ptrs = arg;
+	for (int i = 0; ptrs[i] != NULL; i++) slab_free(ptrs[i]);
+	return NULL;
+}
+
+static void* remote_free_many_worker(void* arg)
+{
+	void** ptrs = arg;
+	int n = 0;
+	while (ptrs[n] != NULL) n++;
+	slab_free_many(ptrs, n);
+	return NULL;
+}
+
+static void test_remote_free()
+{
+	const int n = 1000;
+	void* ptrs[n+1];
+	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(64);
+	ptrs[n] = NULL;
+
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, remote_free_worker, ptrs));
+	AZ(pthread_join(thread, NULL));
+
+	// all frees went to our remote_frees stack; the slab is untouched
+	int slab_size_index = get_slab_size_index_for_sz_log2(6);
+	AN(current_thread->sizes[slab_size_index].remote_frees);
+	ASSERT(get_slab(slab_size_index, 0)->n_allocated == ((n + MAGAZINE_BATCH - 1) / MAGAZINE_BATCH) * MAGAZINE_BATCH);
+
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 1);
+	AZ(n_allocated);
+}
+
+static void* alloc_then_exit_worker(void* arg)
+{
+	void** ptrs = arg;
+	for (int i = 0; i < 100; i++) ptrs[i] = slab_alloc(100);
+	return NULL;
+}
+
+static void test_exited_thread_is_reused()
+{
+	slab_free(slab_alloc(100)); // attach main thread first
+
+	void* ptrs[100];
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, alloc_then_exit_worker, ptrs));
+	AZ(pthread_join(thread, NULL));
+	struct slab_thread* dead = slab_threads;
+	ASSERT(dead != current_thread);
+	AZ(dead->alive);
+
+	// remote frees to an exited thread
+	for (int i = 0; i < 100; i++) slab_free(ptrs[i]);
+	int slab_size_index = get_slab_size_index(100);
+	AN(dead->sizes[slab_size_index].remote_frees);
+
+	// next thread takes over the slab_thread and collects its remote frees
+	AZ(pthread_create(&thread, NULL, alloc_then_exit_worker, ptrs));
+	AZ(pthread_join(thread, NULL));
+	int n_threads = 0;
+	for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) n_threads++;
+	ASSERT(n_threads == 2);
+	AZ(dead->alive);
+	AZ(dead->sizes[slab_size_index].remote_frees);
+	for (int i = 0; i < 100; i++) slab_free(ptrs[i]);
+
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 2);
+	AZ(n_allocated);
+}
+
+// as if slab_*() were called from a TLS destructor that runs after ours
+static void* alloc_after_detach_worker(void* arg)
+{
+	slab_free(slab_alloc(100));
+	struct slab_thread* t = current_thread;
+	detach_thread(t);
+	AZ(current_thread);
+	AZ(t->alive);
+	void* p = slab_alloc(100);
+	AN(current_thread);
+	AN(current_thread->alive);
+	slab_free(p);
+	return NULL;
+}
+
+static void test_alloc_after_detach()
+{
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, alloc_after_detach_worker, NULL));
+	AZ(pthread_join(thread, NULL));
+	for (struct slab_thread* t = slab_threads; t != NULL; t = t->next) AZ(t->alive);
+
+	int n_allocated;
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+}
+
+#define STRESS_THREADS (4)
+#define STRESS_SLOTS (1<<12)
+#define STRESS_OPS (1<<16)
+#define STRESS_MAGIC (0x5ab5ab5ab5ab5ab5ull)
+
+static void* stress_slots[STRESS_SLOTS];
+
+static void stress_check_and_free(void* p)
+{
+	uint64_t* u = p;
+	ASSERT(u[0] == ((uintptr_t)p ^ STRESS_MAGIC));
+	slab_free(p);
+}
+
+static void* stress_worker(void* arg)
+{
+	uint32_t rng = (uintptr_t)arg * 2654435761u + 1;
+	for (int i = 0; i < STRESS_OPS; i++) {
+		rng = rng * 1103515245u + 12345u;
+		int sz_log2 = 4 + ((rng >> 16) % 9);
+		uint64_t* p = slab_alloc_log2(sz_log2);
+		p[0] = (uintptr_t)p ^ STRESS_MAGIC;
+		// swapping with a random slot means most frees are remote
+		void* old = __atomic_exchange_n(&stress_slots[(rng >> 8) & (STRESS_SLOTS-1)], p, __ATOMIC_ACQ_REL);
+		if (old != NULL) stress_check_and_free(old);
+	}
+	return NULL;
+}
+
+static void test_threads_stress()
+{
+	memset(stress_slots, 0, sizeof(stress_slots));
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_t threads[STRESS_THREADS];
+	for (int i = 0; i < STRESS_THREADS; i++) AZ(pthread_create(&threads[i], NULL, stress_worker, (void*)(uintptr_t)i));
+	for (int i = 0; i < STRESS_THREADS; i++) AZ(pthread_join(threads[i], NULL));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	fprintf(stderr, "(%.1f M alloc+free/s) ", (double)STRESS_THREADS * STRESS_OPS / dt * 1e-6);
+
+	for (int i = 0; i < STRESS_SLOTS; i++) if (stress_slots[i] != NULL) stress_check_and_free(stress_slots[i]);
+
+	int n_allocated;
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+}
+
+static long get_rss()
+{
+	FILE* f = fopen("/proc/self/statm", "r");
+	AN(f);
+	long size, resident;
+	ASSERT(fscanf(f, "%ld %ld", &size, &resident) == 2);
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int count_slabs(int sz_log2)
+{
+	return slab_sizes[get_slab_size_index_for_sz_log2(sz_log2)].n_slabs;
+}
+
+#define BURST_SZ_LOG2 (12)
+#define BURST_SLABS (64)
+#define BURST_N (BURST_SLABS << (SLAB_SPACE_LOG2 - BURST_SZ_LOG2))
+static void* burst_ptrs[BURST_N];
+
+static void burst_alloc()
+{
+	for (int i = 0; i < BURST_N; i++) {
+		burst_ptrs[i] = slab_alloc_log2(BURST_SZ_LOG2);
+		memset(burst_ptrs[i], 0x42, 1 << BURST_SZ_LOG2);
+	}
+}
+
+static void burst_free()
+{
+	for (int i = 0; i < BURST_N; i++) slab_free(burst_ptrs[i]);
+}
+
+static void test_burst_is_returned_to_os()
+{
+	long rss0 = get_rss();
+	burst_alloc();
+	ASSERT(count_slabs(BURST_SZ_LOG2) == BURST_SLABS);
+	long rss1 = get_rss();
+	ASSERT(rss1 - rss0 >= (long)(BURST_SLABS - 1) << SLAB_SPACE_LOG2);
+
+	burst_free();
+	slab_thread_flush();
+	ASSERT(count_slabs(BURST_SZ_LOG2) == DEFAULT_RETAINED_EMPTY_SLABS);
+
+	slab_trim();
+	AZ(count_slabs(BURST_SZ_LOG2));
+	AZ(slab_sizes[get_slab_size_index_for_sz_log2(BURST_SZ_LOG2)].n_active_slabs); // table shrunk too
+	long rss2 = get_rss();
+	ASSERT(rss2 - rss0 < 4 << 20);
+
+	// released slab space is reused
+	void* p = slab_alloc_log2(BURST_SZ_LOG2);
+	ASSERT(p == get_slab_begin(get_slab_size_index_for_sz_log2(BURST_SZ_LOG2), 0));
+	slab_free(p);
+}
+
+static void test_retained_empty_slabs()
+{
+	slab_set_retained_empty_slabs(5);
+	burst_alloc();
+	burst_free();
+	slab_thread_flush();
+	ASSERT(count_slabs(BURST_SZ_LOG2) == 5);
+
+	// freeing slabs in the middle leaves holes in the table that are reused
+	slab_set_retained_empty_slabs(0);
+	for (int i = 0; i < BURST_N; i++) burst_ptrs[i] = slab_alloc_log2(BURST_SZ_LOG2);
+	int per_slab = BURST_N / BURST_SLABS;
+	for (int i = per_slab; i < 2*per_slab; i++) slab_free(burst_ptrs[i]);
+	slab_thread_flush();
+	ASSERT(count_slabs(BURST_SZ_LOG2) == BURST_SLABS - 1);
+	ASSERT(slab_sizes[get_slab_size_index_for_sz_log2(BURST_SZ_LOG2)].n_active_slabs == BURST_SLABS);
+	for (int i = per_slab; i < 2*per_slab; i++) burst_ptrs[i] = slab_alloc_log2(BURST_SZ_LOG2);
+	ASSERT(count_slabs(BURST_SZ_LOG2) == BURST_SLABS);
+	ASSERT(slab_sizes[get_slab_size_index_for_sz_log2(BURST_SZ_LOG2)].n_active_slabs == BURST_SLABS);
+	burst_free();
+	slab_thread_flush();
+	AZ(count_slabs(BURST_SZ_LOG2));
+}
+
+static void* burst_worker(void* arg)
+{
+	burst_alloc();
+	burst_free();
+	return NULL;
+}
+
+static void test_trim_exited_threads()
+{
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, burst_worker, NULL));
+	AZ(pthread_join(thread, NULL));
+	ASSERT(count_slabs(BURST_SZ_LOG2) == DEFAULT_RETAINED_EMPTY_SLABS);
+	slab_trim();
+	AZ(count_slabs(BURST_SZ_LOG2));
+}
+
+static void test_non_power_of_two_sizes()
+{
+	// sizes in between powers of two get their own slabs, and no more room
+	uint8_t* p80 = slab_alloc(65);
+	uint8_t* q80 = slab_alloc(80);
+	uint8_t* p96 = slab_alloc(81);
+	ASSERT(q80 - p80 == 80);
+	ASSERT(get_slab_for_ptr(p80, NULL) != get_slab_for_ptr(p96, NULL));
+
+	int n = get_max_allocations(get_slab_size_index(80)) - 2;
+	for (int i = 0; i < n; i++) slab_alloc(80);
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 2);
+	ASSERT(n_allocated == n + 3);
+
+	slab_free(q80);
+	slab_free(p96);
+	slab_free(p80);
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	ASSERT(n_allocated == n);
+}
+
+static void test_stats()
+{
+	const int n = 1000;
+	void* ptrs[n];
+	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(48);
+
+	struct slab_stats stats;
+	slab_get_stats(&stats);
+	struct slab_size_stats* st = &stats.sizes[get_slab_size_index(48)];
+	ASSERT(st->item_size == 48);
+	ASSERT(st->n_allocs == n);
+	ASSERT(st->n_live == n);
+	ASSERT(st->n_peak == ((n + MAGAZINE_BATCH - 1) / MAGAZINE_BATCH) * MAGAZINE_BATCH);
+	ASSERT(st->n_slabs == 1);
+	ASSERT(st->n_new_slabs == 1);
+	ASSERT(st->n_refills == (n + MAGAZINE_BATCH - 1) / MAGAZINE_BATCH);
+	ASSERT(st->bytes_reserved == 1 << SLAB_SPACE_LOG2);
+	ASSERT(st->bytes_used == n * 48);
+	ASSERT(stats.n_live == n);
+
+	// free half locally, and a hundred from another thread
+	for (int i = 0; i < n/2; i++) slab_free(ptrs[i]);
+	void* remote[101];
+	memcpy(remote, &ptrs[n/2], 100 * sizeof(*remote));
+	remote[100] = NULL;
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, remote_free_worker, remote));
+	AZ(pthread_join(thread, NULL));
+
+	slab_get_stats(&stats);
+	ASSERT(st->n_frees == n/2 + 100);
+	ASSERT(st->n_remote_frees == 100);
+	ASSERT(st->n_live == n/2 - 100);
+
+	for (int i = n/2 + 100; i < n; i++) slab_free(ptrs[i]);
+	slab_trim();
+	slab_get_stats(&stats);
+	AZ(st->n_live);
+	AZ(st->n_slabs);
+	ASSERT(st->n_released_slabs == 1);
+	AZ(stats.bytes_reserved);
+}
+
 static void fail_to_free_invalid_ptr()
 {
 	uint8_t* p = slab_alloc(32);
-	ut_assert = "ASSERT((allocation_index << sz_log2) == allocation_offset) failed in slab_free";
+	ut_assert = "ASSERT(allocation_index * get_item_size(slab_size_index) == allocation_offset) failed in check_allocation";
 	slab_free(p + 1);
 }
 
+static void fail_to_free_foreign_ptr()
+{
+	int x;
+	slab_free(slab_alloc(32)); // make sure slab_space is reserved
+	ut_assert = "ASSERT(((uintptr_t)p & (LARGE_PAGE_SIZE - 1)) == LARGE_HEADER_SIZE) failed in large_free";
+	slab_free(&x);
+}
+
+static void fail_to_free_large_ptr_with_bad_header()
+{
+	uint8_t* p = slab_alloc(100000);
+	uint8_t* q = slab_alloc(100000);
+	memcpy(q - LARGE_HEADER_SIZE, p - LARGE_HEADER_SIZE, LARGE_HEADER_SIZE); // header copied from elsewhere
+	ut_assert = "ASSERT(h->magic == (LARGE_MAGIC ^ (uintptr_t)h)) failed in large_free";
+	slab_free(q);
+}
+
+static void test_growing_past_256_slabs()
+{
+	const int sz = 4096;
+	const int n_slabs = 300;
+	const int slab_size_index = get_slab_size_index(sz);
+	const int n = n_slabs * get_max_allocations(slab_size_index);
+	static void* ptrs[300 << (SLAB_SPACE_LOG2 - 12)];
+	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(sz);
+	ASSERT(count_slabs(12) == n_slabs);
+	AN(slab_sizes[slab_size_index].chunks[1]);
+	ASSERT(current_thread->sizes[slab_size_index].nonfull.n_words == 8);
+
+	// frees reach slabs in both chunks, and new allocations find them
+	slab_free(ptrs[0]);
+	slab_free(ptrs[n-1]);
+	slab_thread_flush();
+	void* a = slab_alloc(sz);
+	void* b = slab_alloc(sz);
+	ASSERT((a == ptrs[0] && b == ptrs[n-1]) || (a == ptrs[n-1] && b == ptrs[0]));
+	slab_free(a);
+	slab_free(b);
+
+	for (int i = 1; i < n-1; i++) slab_free(ptrs[i]);
+	slab_trim();
+	AZ(count_slabs(12));
+	AZ(slab_sizes[slab_size_index].chunks[0]);
+	AZ(slab_sizes[slab_size_index].chunks[1]);
+}
+
+static void test_large_objects()
+{
+	size_t sizes[] = { 65536 + 1, 100000, 1 << 20, 100 << 20 };
+	const int n = sizeof(sizes) / sizeof(*sizes);
+	uint8_t* ptrs[n];
+	for (int i = 0; i < n; i++) {
+		ptrs[i] = slab_calloc(sizes[i]);
+		ASSERT(((uintptr_t)ptrs[i] & 63) == 0);
+		ASSERT(ptrs[i][0] == 0 && ptrs[i][sizes[i] - 1] == 0);
+		memset(ptrs[i], 0x42, sizes[i]);
+	}
+	uint8_t* p = slab_alloc_log2(17);
+	memset(p, 0x42, 1 << 17);
+	AZ(count_slabs(16));
+
+	struct slab_stats stats;
+	slab_get_stats(&stats);
+	ASSERT(stats.n_large == n + 1);
+	ASSERT(stats.bytes_large >= (100 << 20) + (1 << 20));
+	ASSERT(stats.n_large_allocs == n + 1);
+	AZ(stats.n_slabs);
+
+	// large and slab allocations are told apart by address, also remotely
+	void* remote[n + 3];
+	for (int i = 0; i < n; i++) remote[i] = ptrs[i];
+	remote[n] = slab_alloc(16);
+	remote[n + 1] = p;
+	remote[n + 2] = NULL;
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, remote_free_worker, remote));
+	AZ(pthread_join(thread, NULL));
+
+	slab_get_stats(&stats);
+	AZ(stats.n_large);
+	AZ(stats.bytes_large);
+	ASSERT(stats.n_large_frees == n + 1);
+
+	int n_allocated;
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+}
+
+static void test_alloc_many_free_many()
+{
+	const int sz = 48;
+	const int slab_size_index = get_slab_size_index(sz);
+	const int n = get_max_allocations(slab_size_index) + 1000; // spills into a second slab
+	static void* ptrs[(1 << SLAB_SPACE_LOG2) / 48 + 1000];
+
+	void* cached = slab_alloc(sz); // leaves the rest of a batch in the magazine
+	slab_alloc_many(sz, ptrs, n);
+	ASSERT(current_thread->sizes[slab_size_index].magazine.n < MAGAZINE_BATCH);
+	for (int i = 0; i < n; i++) {
+		AN(ptrs[i]);
+		ASSERT(ptrs[i] != cached);
+		memset(ptrs[i], 0x42, sz);
+	}
+	int n_active_slabs, n_allocated;
+	count_active_slabs_and_allocated(&n_active_slabs, &n_allocated);
+	ASSERT(n_active_slabs == 2);
+	ASSERT(n_allocated == n + 1);
+
+	// all distinct
+	uint8_t* seen = mem_calloc(2 << SLAB_SPACE_LOG2 >> 4);
+	for (int i = 0; i < n; i++) {
+		size_t k = ((uint8_t*)ptrs[i] - (uint8_t*)get_slab_begin(slab_size_index, 0)) >> 4;
+		AZ(seen[k]);
+		seen[k] = 1;
+	}
+	mem_free(seen);
+
+	struct slab_stats stats;
+	slab_get_stats(&stats);
+	ASSERT(stats.sizes[slab_size_index].n_allocs == n + 1);
+
+	// free the first half remotely, the rest locally along with a large and a
+	// differently sized allocation
+	void* remote[1001];
+	memcpy(remote, ptrs, 1000 * sizeof(*remote));
+	remote[1000] = NULL;
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, remote_free_many_worker, remote));
+	AZ(pthread_join(thread, NULL));
+	AN(current_thread->sizes[slab_size_index].remote_frees);
+
+	ptrs[0] = slab_alloc(100000);
+	ptrs[1] = cached;
+	ptrs[2] = slab_alloc(16);
+	slab_free_many(ptrs, 3);
+	slab_free_many(&ptrs[1000], n - 1000);
+
+	slab_get_stats(&stats);
+	ASSERT(stats.sizes[slab_size_index].n_frees == n + 1);
+	ASSERT(stats.sizes[slab_size_index].n_remote_frees == 1000);
+	AZ(stats.n_large);
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+
+	// and large sizes
+	slab_alloc_many_log2(17, ptrs, 3);
+	slab_get_stats(&stats);
+	ASSERT(stats.n_large == 3);
+	slab_free_many(ptrs, 3);
+}
+
+static void fail_to_free_many_invalid_ptr()
+{
+	void* ptrs[3];
+	slab_alloc_many(32, ptrs, 3);
+	ptrs[2] = (uint8_t*)ptrs[2] + 8;
+	ut_assert = "ASSERT(allocation_index * get_item_size(slab_size_index) == allocation_offset) failed in check_allocation";
+	slab_free_many(ptrs, 3);
+}
+
+static void test_poisoning()
+{
+	uint64_t* p = slab_alloc(64);
+	memset(p, 0, 64);
+	slab_free(p);
+	for (int i = 0; i < 8; i++) ASSERT(p[i] == POISON_WORD);
+	ASSERT(slab_alloc(64) == p); // and the poison was found intact
+	slab_free(p);
+
+	// only the head of larger allocations is poisoned
+	uint8_t* q = slab_alloc(1024);
+	memset(q, 0, 1024);
+	slab_free(q);
+	ASSERT(q[POISON_MAX - 1] == POISON_BYTE);
+	AZ(q[POISON_MAX]);
+	q[POISON_MAX] = 1;
+	ASSERT(slab_alloc(1024) == q);
+	slab_free(q);
+}
+
+static void fail_on_double_free()
+{
+	void* p = slab_alloc(64);
+	slab_free(p);
+	ut_assert = "ASSERT((was_live) != 0) failed in debug_free";
+	slab_free(p);
+}
+
+static void fail_on_double_free_after_flush()
+{
+	void* p = slab_alloc(64);
+	slab_free(p);
+	slab_thread_flush();
+	ut_assert = "ASSERT((was_live) != 0) failed in debug_free";
+	slab_free(p);
+}
+
+static void fail_on_double_free_many()
+{
+	void* ptrs[4];
+	slab_alloc_many(64, ptrs, 3);
+	ptrs[3] = ptrs[1];
+	ut_assert = "ASSERT((was_live) != 0) failed in debug_free";
+	slab_free_many(ptrs, 4);
+}
+
+static void fail_on_remote_double_free()
+{
+	void* ptrs[2] = { slab_alloc(64), NULL };
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, remote_free_worker, ptrs));
+	AZ(pthread_join(thread, NULL));
+	ut_assert = "ASSERT((was_live) != 0) failed in debug_free";
+	slab_free(ptrs[0]);
+}
+
+static void fail_to_free_unallocated_slot()
+{
+	uint8_t* p = slab_alloc(64);
+	ut_assert = "ASSERT((was_live) != 0) failed in debug_free";
+	slab_free(p + 64 * (MAGAZINE_BATCH + 1)); // valid slot in the same slab, never handed out
+}
+
+static void fail_on_write_after_free()
+{
+	uint8_t* p = slab_alloc(64);
+	slab_free(p);
+	p[20] = 1;
+	ut_assert = "ASSERT(w[j] == POISON_WORD) failed in debug_alloc";
+	slab_alloc(64);
+}
+
+// returns 1 if [p, p+sz) is mapped read/write
+static int is_committed(void* p, size_t sz)
+{
+	FILE* f = fopen("/proc/self/maps", "r");
+	AN(f);
+	uintptr_t at = (uintptr_t)p;
+	uintptr_t end = at + sz;
+	char line[512];
+	while (at < end && fgets(line, sizeof(line), f) != NULL) {
+		unsigned long lo, hi;
+		char perms[5];
+		if (sscanf(line, "%lx-%lx %4s", &lo, &hi, perms) != 3) continue;
+		if (lo <= at && at < hi) {
+			if (perms[0] != 'r' || perms[1] != 'w') break;
+			at = hi;
+		}
+	}
+	fclose(f);
+	return at >= end;
+}
+
+static void test_huge_pages()
+{
+	if (slab_set_huge_pages(1) == -1) {
+		fprintf(stderr, "(not supported) ");
+		return;
+	}
+	const int slab_size_index = get_slab_size_index(4096);
+	const int per_slab = get_max_allocations(slab_size_index);
+	const size_t slab_sz = 1 << SLAB_SPACE_LOG2;
+
+	// the first slab of a group commits the whole group
+	void* ptrs[512];
+	slab_alloc_many(4096, ptrs, per_slab);
+	uint8_t* slab0 = get_slab_begin(slab_size_index, 0);
+	uint8_t* slab1 = get_slab_begin(slab_size_index, 1);
+	ASSERT((void*)slab0 == ptrs[0]);
+	AZ((uintptr_t)slab0 & ((1 << SYS_VM_HUGE_PAGE_LOG2) - 1));
+	ASSERT(is_committed(slab0, 1 << SYS_VM_HUGE_PAGE_LOG2));
+	slab_alloc_many(4096, &ptrs[per_slab], 1);
+	ASSERT((void*)slab1 == ptrs[per_slab]);
+
+	// ... but is released slab by slab while the rest of the group is in use
+	slab_set_retained_empty_slabs(0);
+	slab_free(ptrs[per_slab]);
+	slab_thread_flush();
+	ASSERT(count_slabs(12) == 1);
+	ASSERT(is_committed(slab0, slab_sz));
+	AZ(is_committed(slab1, 4096));
+
+	slab_free_many(ptrs, per_slab);
+	slab_thread_flush();
+	AZ(count_slabs(12));
+	AZ(is_committed(slab0, 4096));
+
+	// off again; slabs are committed one by one
+	AZ(slab_set_huge_pages(0));
+	slab_free(slab_alloc(4096));
+	ASSERT(is_committed(slab0, slab_sz));
+	AZ(is_committed(slab1, 4096));
+}
+
+struct test_node {
+	struct test_node* next;
+	int value;
+	char pad[36];
+};
+POOL_DECLARE(test_node, struct test_node)
+
+static void* pool_free_worker(void* arg)
+{
+	struct test_node* n = arg;
+	while (n != NULL) {
+		struct test_node* next = n->next;
+		test_node_pool_free(n);
+		n = next;
+	}
+	test_node_pool_flush();
+	return NULL;
+}
+
+static void test_pool()
+{
+	const int slab_size_index = get_slab_size_index(sizeof(struct test_node));
+	struct pool* pool = test_node_pool_get();
+	memset(pool, 0, sizeof(*pool));
+
+	// first alloc refills a batch from the slab; the rest come from the pool
+	struct test_node* a = test_node_pool_alloc();
+	ASSERT(pool->n_refills == 1);
+	ASSERT(pool->n_free == POOL_BATCH - 1);
+	struct test_node* b = test_node_pool_calloc();
+	AZ(b->value);
+	ASSERT(get_slab_for_ptr(a, NULL) == get_slab_for_ptr(b, NULL));
+
+	// LIFO reuse
+	test_node_pool_free(a);
+	ASSERT(test_node_pool_alloc() == a);
+	test_node_pool_free(b);
+	test_node_pool_free(a);
+
+	// a full pool spills a batch back to the slab
+	const int n = POOL_MAX_FREE + 100;
+	struct test_node* list = NULL;
+	for (int i = 0; i < n; i++) {
+		struct test_node* node = test_node_pool_alloc();
+		node->next = list;
+		node->value = i;
+		list = node;
+	}
+	while (list != NULL) {
+		struct test_node* next = list->next;
+		test_node_pool_free(list);
+		list = next;
+	}
+	ASSERT(pool->n_free <= POOL_MAX_FREE);
+	AN(pool->n_spills);
+	ASSERT(pool->n_allocs == n + 3);
+	ASSERT(pool->n_frees == n + 3);
+
+	struct slab_stats stats;
+	slab_get_stats(&stats);
+	ASSERT(stats.sizes[slab_size_index].n_live == pool->n_free); // pooled objects are live to the slab
+
+	// objects freed on another thread end up in that thread's pool, then the slab
+	for (int i = 0; i < 10; i++) {
+		struct test_node* node = test_node_pool_alloc();
+		node->next = list;
+		list = node;
+	}
+	pthread_t thread;
+	AZ(pthread_create(&thread, NULL, pool_free_worker, list));
+	AZ(pthread_join(thread, NULL));
+
+	test_node_pool_flush();
+	AZ(pool->n_free);
+	AZ(pool->free);
+	slab_get_stats(&stats);
+	AZ(stats.sizes[slab_size_index].n_live);
+	int n_allocated;
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+}
+
+static void test_slab_lookup_by_address()
+{
+	void* p0 = slab_alloc(16);
+	void* p1 = slab_alloc(1 << 16);
+	ASSERT(p0 == get_slab_begin(0, 0));
+	ASSERT(p1 == get_slab_begin(NUM_SIZES - 1, 0));
+	ASSERT(((uintptr_t)p0 & ((1 << SLAB_SPACE_LOG2) - 1)) == 0);
+	ASSERT(((uintptr_t)p1 & ((1 << SLAB_SPACE_LOG2) - 1)) == 0);
+	slab_free(p1);
+	slab_free(p0);
+
+	int n_allocated;
+	count_active_slabs_and_allocated(NULL, &n_allocated);
+	AZ(n_allocated);
+}
+
 void pre_test()
 {
 	memset(slab_sizes, 0, sizeof(slab_sizes));
-	n_ptr_ranges = 0;
-	memset(ptr_ranges, 0, sizeof(ptr_ranges));
+	n_large_live = bytes_large = n_large_allocs = n_large_frees = 0;
+	slab_threads = NULL;
+	current_thread = NULL;
+	retained_empty_slabs = DEFAULT_RETAINED_EMPTY_SLABS;
+	huge_pages = 0;
 }
 
 void post_test()
 {
+	flush_all_threads();
+	check_nonfull_bitmaps();
 	for (int i = 0; i < NUM_SIZES; i++) {
 		struct slab_size* ss = &slab_sizes[i];
-		ss->last_used = 0;
 		if (!ss->n_active_slabs) continue;
 		for (int j = 0; j < ss->n_active_slabs; j++) {
-			struct slab* s = &ss->slabs[j];
-			mem_free(s->begin);
+			struct slab* s = get_slab(i, j);
+			if (s->begin == NULL) continue;
 			mem_free(s->freelist);
 			memset(s, 0, sizeof(*s));
 		}
+		for (int j = 0; j < MAX_SLAB_CHUNKS; j++) if (ss->chunks[j] != NULL) mem_free(ss->chunks[j]);
 		memset(ss, 0, sizeof(*ss));
 	}
 
@@ -472,7 +2154,20 @@ void post_test()
 	AZ(n_active_slabs);
 	AZ(n_allocated);
 
-	n_ptr_ranges = 0;
+	while (slab_threads != NULL) {
+		struct slab_thread* t = slab_threads;
+		slab_threads = t->next;
+		for (int i = 0; i < NUM_SIZES; i++) nonfull_free(&t->sizes[i].nonfull);
+		mem_free(t);
+	}
+	AZ(n_large_live);
+	AZ(bytes_large);
+	current_thread = NULL;
+
+	if (slab_space != NULL) {
+		sys_vm_release(slab_space, SLAB_TOTAL_SPACE);
+		slab_space = NULL;
+	}
 }
 
 void run_tests()
@@ -484,7 +2179,307 @@ void run_tests()
 	TEST(test_using_multiple_slabs_per_size);
 	TEST(test_freeing_stuff);
 	TEST(test_freeing_multiple_sizes);
+	TEST(test_slab_lookup_by_address);
+	TEST(test_non_power_of_two_sizes);
+	TEST(test_growing_past_256_slabs);
+	TEST(test_large_objects);
+	TEST(test_alloc_many_free_many);
+	TEST(test_huge_pages);
+	TEST(test_pool);
+	TEST(test_remote_free);
+	TEST(test_exited_thread_is_reused);
+	TEST(test_alloc_after_detach);
+	TEST(test_threads_stress);
+	TEST(test_burst_is_returned_to_os);
+	TEST(test_retained_empty_slabs);
+	TEST(test_trim_exited_threads);
+	TEST(test_stats);
 	TEST(fail_to_free_invalid_ptr);
+	TEST(fail_to_free_foreign_ptr);
+	TEST(fail_to_free_large_ptr_with_bad_header);
+	TEST(fail_to_free_many_invalid_ptr);
+	TEST(test_poisoning);
+	TEST(fail_on_double_free);
+	TEST(fail_on_double_free_after_flush);
+	TEST(fail_on_double_free_many);
+	TEST(fail_on_remote_double_free);
+	TEST(fail_to_free_unallocated_slot);
+	TEST(fail_on_write_after_free);
+}
+
+#endif
+
+
+#ifdef BENCHMARK
+
+#include "pool.h"
+
+/* object sizes roughly like ours: mostly small nodes and strings, with a
+ * long tail of buffers */
+static size_t bench_random_size()
+{
+	uint32_t r = bench_rng();
+	int sz_log2 = 4 + (r % 100 < 70 ? (r >> 8) % 4 : (r >> 8) % 12);
+	size_t sz = ((size_t)1 << sz_log2) + ((r >> 16) % ((size_t)1 << sz_log2));
+	if (sz > ITEM_SIZE_MALLOC_THRESHOLD_MAX) sz = ITEM_SIZE_MALLOC_THRESHOLD_MAX;
+	return sz;
+}
+
+#define FRAG_N (1 << 17)
+
+static void bench_fragmentation()
+{
+	static void* ptrs[FRAG_N];
+	size_t requested = 0;
+	size_t pow2 = 0;
+	size_t classes = 0;
+	for (int i = 0; i < FRAG_N; i++) {
+		size_t sz = bench_random_size();
+		requested += sz;
+		pow2 += (size_t)1 << slab_sz_log2(sz < 16 ? 16 : sz);
+		classes += get_item_size(get_slab_size_index(sz));
+		ptrs[i] = slab_alloc(sz);
+	}
+	slab_thread_flush();
+
+	size_t committed = 0;
+	for (int i = 0; i < NUM_SIZES; i++) committed += (size_t)slab_sizes[i].n_slabs << SLAB_SPACE_LOG2;
+
+	printf("%d objects, %.1f MiB requested\n", FRAG_N, requested / 1048576.0);
+	printf("  power-of-two rounding: %8.1f MiB (%.1f%% wasted)\n", pow2 / 1048576.0, 100.0 * (pow2 - requested) / pow2);
+	printf("  size classes:          %8.1f MiB (%.1f%% wasted)\n", classes / 1048576.0, 100.0 * (classes - requested) / classes);
+	printf("  committed slab memory: %8.1f MiB\n", committed / 1048576.0);
+	fflush(stdout);
+	slab_dump_stats();
+
+	for (int i = 0; i < FRAG_N; i++) slab_free(ptrs[i]);
+	slab_trim();
+}
+
+static void bench_alloc_free()
+{
+	const int n = 1 << 12;
+	const int rounds = 1 << 10;
+	static void* ptrs[1 << 12];
+	static size_t sizes[1 << 12];
+	for (int i = 0; i < n; i++) sizes[i] = bench_random_size();
+
+	double t0 = bench_time();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(sizes[i]);
+		for (int i = 0; i < n; i++) slab_free(ptrs[i]);
+	}
+	double dt = bench_time() - t0;
+	printf("slab_alloc+slab_free: %.1f ns/pair\n", dt * 1e9 / ((double)n * rounds));
+	slab_trim();
+}
+
+/* allocation latency when the magazine is empty and the only slab with
+ * room is a random one among n_slabs full slabs */
+#define REFILL_MAX_SLABS (4096)
+static void bench_refill_vs_slab_count()
+{
+	const int slab_size_index = get_slab_size_index(4096);
+	const int per_slab = get_max_allocations(slab_size_index);
+	const int trials = 1 << 14;
+	static void* ptrs[REFILL_MAX_SLABS << (SLAB_SPACE_LOG2 - 12)];
+
+	slab_set_retained_empty_slabs(REFILL_MAX_SLABS);
+	for (int n_slabs = 1; n_slabs <= REFILL_MAX_SLABS; n_slabs *= 4) {
+		int n = n_slabs * per_slab;
+		for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(4096);
+		struct slab_thread_size* ts = &current_thread->sizes[slab_size_index];
+		AZ(ts->magazine.n);
+
+		double total = 0;
+		for (int i = 0; i < trials; i++) {
+			int j = bench_rng() % n;
+			slab_free(ptrs[j]);
+			magazine_flush(ts, slab_size_index, ts->magazine.n);
+			double t0 = bench_time();
+			ptrs[j] = slab_alloc(4096);
+			total += bench_time() - t0;
+		}
+		printf("%4d slabs: %.1f ns/refill\n", n_slabs, total * 1e9 / trials);
+
+		for (int i = 0; i < n; i++) slab_free(ptrs[i]);
+		slab_trim();
+	}
+	slab_set_retained_empty_slabs(DEFAULT_RETAINED_EMPTY_SLABS);
+}
+
+static void bench_large_alloc_free()
+{
+	const int n = 1 << 12;
+	static void* ptrs[1 << 12];
+	double t0 = bench_time();
+	for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(ITEM_SIZE_MALLOC_THRESHOLD_MAX + 1 + (bench_rng() % (1 << 20)));
+	for (int i = 0; i < n; i++) slab_free(ptrs[i]);
+	double dt = bench_time() - t0;
+	printf("large slab_alloc+slab_free: %.1f us/pair\n", dt * 1e6 / n);
+}
+
+/* many same-sized objects created and destroyed together, one by one vs.
+ * in batches */
+static void bench_many_vs_loop()
+{
+	const int n = 1 << 12;
+	const int rounds = 1 << 10;
+	static void* ptrs[1 << 12];
+	int sizes[] = { 32, 64, 256 };
+	for (int s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+		int sz = sizes[s];
+
+		double t0 = bench_time();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(sz);
+			for (int i = 0; i < n; i++) slab_free(ptrs[i]);
+		}
+		double dt_loop = bench_time() - t0;
+
+		t0 = bench_time();
+		for (int r = 0; r < rounds; r++) {
+			slab_alloc_many(sz, ptrs, n);
+			slab_free_many(ptrs, n);
+		}
+		double dt_many = bench_time() - t0;
+
+		printf("%4d bytes: loop %.1f ns/pair, many %.1f ns/pair\n",
+			sz,
+			dt_loop * 1e9 / ((double)n * rounds),
+			dt_many * 1e9 / ((double)n * rounds));
+		slab_trim();
+	}
+}
+
+static long get_anon_huge_kb()
+{
+	FILE* f = fopen("/proc/self/smaps_rollup", "r");
+	if (f == NULL) return -1;
+	char line[256];
+	long kb = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb;
+}
+
+/* allocating and touching a working set far beyond what the TLB covers
+ * with 4KiB pages, then randomly accessing it, with and without huge pages */
+#define HUGE_BENCH_N (1 << 20)
+#define HUGE_BENCH_SZ (256)
+#define HUGE_BENCH_ACCESSES (1 << 24)
+static void bench_huge_pages()
+{
+	static void* ptrs[HUGE_BENCH_N];
+	for (int on = 0; on <= 1; on++) {
+		if (slab_set_huge_pages(on) == -1) {
+			printf("huge pages not supported\n");
+			break;
+		}
+
+		double t0 = bench_time();
+		slab_alloc_many(HUGE_BENCH_SZ, ptrs, HUGE_BENCH_N);
+		for (int i = 0; i < HUGE_BENCH_N; i++) memset(ptrs[i], i, HUGE_BENCH_SZ);
+		double dt_touch = bench_time() - t0;
+		long huge_kb = get_anon_huge_kb();
+
+		// link the objects in random order and chase the pointers
+		for (int i = HUGE_BENCH_N - 1; i > 0; i--) {
+			int j = bench_rng() % (i + 1);
+			void* tmp = ptrs[i];
+			ptrs[i] = ptrs[j];
+			ptrs[j] = tmp;
+		}
+		for (int i = 0; i < HUGE_BENCH_N; i++) *(void**)ptrs[i] = ptrs[(i + 1) & (HUGE_BENCH_N - 1)];
+		void* p = ptrs[0];
+		t0 = bench_time();
+		for (int i = 0; i < HUGE_BENCH_ACCESSES; i++) p = *(void**)p;
+		double dt_access = bench_time() - t0;
+		AN(p);
+
+		printf("%s pages: alloc+touch %.1f ns/object, random access %.1f ns (%ld MiB in huge pages)\n",
+			on ? "huge" : "4KiB",
+			dt_touch * 1e9 / HUGE_BENCH_N,
+			dt_access * 1e9 / HUGE_BENCH_ACCESSES,
+			huge_kb / 1024);
+
+		slab_free_many(ptrs, HUGE_BENCH_N);
+		slab_trim();
+	}
+	slab_set_huge_pages(0);
+}
+
+struct bench_node {
+	struct bench_node* next;
+	uint64_t key;
+	void* data;
+	int len, flags;
+	char pad[16];
+};
+POOL_DECLARE(bench_node, struct bench_node)
+
+/* our most common pattern: a node allocated and freed soon after (hot
+ * reuse), and lists of nodes built and torn down */
+static void bench_pool()
+{
+	const int pairs = 1 << 24;
+	const size_t sz = sizeof(struct bench_node);
+	static void* ptrs[1 << 12];
+
+	double t0 = bench_time();
+	for (int i = 0; i < pairs; i++) {
+		void* p = slab_alloc(sz);
+		__asm__ volatile("" : : "r"(p) : "memory");
+		slab_free(p);
+	}
+	double dt_slab_pair = bench_time() - t0;
+
+	t0 = bench_time();
+	for (int i = 0; i < pairs; i++) {
+		struct bench_node* p = bench_node_pool_alloc();
+		__asm__ volatile("" : : "r"(p) : "memory");
+		bench_node_pool_free(p);
+	}
+	double dt_pool_pair = bench_time() - t0;
+
+	printf("alloc+free right away: slab %.1f ns, pool %.1f ns\n", dt_slab_pair * 1e9 / pairs, dt_pool_pair * 1e9 / pairs);
+
+	// lists that fit in the pool, and ones that don't
+	for (int n = POOL_MAX_FREE; n <= (1 << 12); n *= 16) {
+		const int rounds = pairs / n;
+		t0 = bench_time();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < n; i++) ptrs[i] = slab_alloc(sz);
+			for (int i = 0; i < n; i++) slab_free(ptrs[i]);
+		}
+		double dt_slab_list = bench_time() - t0;
+
+		t0 = bench_time();
+		for (int r = 0; r < rounds; r++) {
+			for (int i = 0; i < n; i++) ptrs[i] = bench_node_pool_alloc();
+			for (int i = 0; i < n; i++) bench_node_pool_free(ptrs[i]);
+		}
+		double dt_pool_list = bench_time() - t0;
+
+		printf("%d allocs, then %d frees: slab %.1f ns/pair, pool %.1f ns/pair\n", n, n,
+			dt_slab_list * 1e9 / ((double)n * rounds),
+			dt_pool_list * 1e9 / ((double)n * rounds));
+	}
+	bench_node_pool_flush();
+	slab_trim();
+}
+
+void run_benchmarks()
+{
+	BENCH(bench_fragmentation);
+	BENCH(bench_alloc_free);
+	BENCH(bench_refill_vs_slab_count);
+	BENCH(bench_large_alloc_free);
+	BENCH(bench_many_vs_loop);
+	BENCH(bench_huge_pages);
+	BENCH(bench_pool);
 }
 
 #endif
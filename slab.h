@@ -1,5 +1,11 @@
 #ifndef SLAB_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_NUM_SIZES (44)
+#define SLAB_MAX_ITEM_SIZE (65536)
+
 static inline int slab_sz_log2(size_t sz)
 {
 	sz--;
@@ -8,26 +14,95 @@ static inline int slab_sz_log2(size_t sz)
 	return x;
 }
 
+/* allocations up to 64KiB are served from slabs. slab_alloc() rounds sz up
+ * to the nearest size class (4 per doubling); slab_alloc_log2() and
+ * friends take the power-of-two exponent of the size instead. larger
+ * allocations are mapped directly (rounded up to pages), and are freed with
+ * slab_free() like any other. slab_can_alloc() only fails when a size class
+ * has used up its address space (64GiB) */
+int slab_can_alloc(size_t sz);
+void* slab_alloc(size_t sz);
+void* slab_calloc(size_t sz);
+
 int slab_can_alloc_log2(int sz_log2);
 void* slab_alloc_log2(int sz_log2);
 void* slab_calloc_log2(int sz_log2);
 
-static inline int slab_can_alloc(size_t sz)
+/* size class of an allocation of sz bytes (at most SLAB_MAX_ITEM_SIZE); a
+ * constant when sz is, so allocators of fixed size objects (see pool.h)
+ * can skip the lookup slab_alloc() does */
+static inline int slab_size_class(size_t sz)
 {
-	return slab_can_alloc_log2(slab_sz_log2(sz));
+	if (sz <= 64) return sz <= 16 ? 0 : (sz - 1) >> 4;
+	// sz in (2^k, 2^(k+1)]; the two bits below the leading one pick the class
+	int k = 63 - __builtin_clzll(sz - 1);
+	return 4 + ((k - 6) << 2) + (((sz - 1) >> (k - 2)) & 3);
 }
 
-static inline void* slab_alloc(size_t sz)
-{
-	return slab_alloc_log2(slab_sz_log2(sz));
-}
-
-static inline void* slab_calloc(size_t sz)
-{
-	return slab_calloc_log2(slab_sz_log2(sz));
-}
+void* slab_alloc_class(int size_class);
+void slab_alloc_many_class(int size_class, void** ptrs, int n);
 
+/* slab_free() may be called from any thread, also on pointers allocated by
+ * another thread */
 void slab_free(void* p);
 
+/* batch versions, for objects that come and go together. slab_alloc_many()
+ * stores n allocations of the same size in ptrs; slab_free_many() frees n
+ * pointers of any size and origin, but is fastest when pointers into the
+ * same slab are next to each other (as returned by slab_alloc_many()) */
+void slab_alloc_many(size_t sz, void** ptrs, int n);
+void slab_alloc_many_log2(int sz_log2, void** ptrs, int n);
+void slab_free_many(void** ptrs, int n);
+
+// number of allocations (of any size and kind) made by the calling thread
+uint64_t slab_thread_allocs();
+
+/* returns the calling thread's cached free allocations to the slabs; worth
+ * calling before a thread goes idle for a long time (happens automatically
+ * when a thread exits) */
+void slab_thread_flush();
+
+/* completely free slabs beyond n per size (per thread) are returned to the
+ * OS as soon as they become free. default is 1 */
+void slab_set_retained_empty_slabs(int n);
+
+/* flushes the calling thread's cache and returns all of its completely free
+ * slabs to the OS, as well as those of exited threads. call when idle */
+void slab_trim();
+
+/* backs slabs with transparent huge pages (2MiB) when possible, for fewer
+ * TLB misses on large working sets, at the cost of coarser release of
+ * memory to the OS. off by default; affects slabs created from now on.
+ * returns -1 if the kernel doesn't support it (and leaves it off) */
+int slab_set_huge_pages(int enable);
+
+struct slab_size_stats {
+	size_t item_size;
+	size_t n_live; // allocated and not yet freed
+	size_t n_peak; // peak allocations out of slabs (including those cached per thread)
+	size_t n_slabs;
+	size_t bytes_reserved; // committed slab memory
+	size_t bytes_used; // n_live * item_size
+	uint64_t n_allocs, n_frees;
+	uint64_t n_remote_frees; // frees from a thread not owning the slab
+	uint64_t n_refills, n_flushes; // thread cache slow paths
+	uint64_t n_new_slabs, n_released_slabs;
+};
+
+struct slab_stats {
+	size_t n_live, n_slabs, bytes_reserved, bytes_used;
+	struct slab_size_stats sizes[SLAB_NUM_SIZES];
+
+	// allocations above 64KiB; not included in the totals above
+	size_t n_large, bytes_large;
+	uint64_t n_large_allocs, n_large_frees;
+};
+
+/* counters are always on; they're per thread (or only touched in slow
+ * paths) so they cost next to nothing. slab_dump_stats() prints them to
+ * stderr */
+void slab_get_stats(struct slab_stats*);
+void slab_dump_stats();
+
 #define SLAB_H
 #endif
@@ -10,5 +10,28 @@ struct sys_mmap_file {
 int sys_mmap_file_ro(struct sys_mmap_file*, const char* path);
 void sys_munmap_file(struct sys_mmap_file*);
 
+/* virtual memory. sys_vm_reserve() reserves sz bytes of address space aligned
+ * to 1<<align_log2 without backing it by memory (returns NULL on failure);
+ * pages inside a reservation must be committed before use. sz, and all
+ * commit/decommit ranges, must be page aligned */
+void* sys_vm_reserve(size_t sz, int align_log2);
+void sys_vm_release(void* p, size_t sz);
+int sys_vm_commit(void* p, size_t sz);
+int sys_vm_decommit(void* p, size_t sz);
+
+/* maps sz bytes of committed, zeroed memory (NULL on failure); release with
+ * sys_vm_release() */
+void* sys_vm_map(size_t sz);
+
+/* transparent huge pages; SYS_VM_HUGE_PAGE_LOG2 is the (x86-64) huge page
+ * size. sys_vm_advise_huge() asks for a range to be backed by huge pages
+ * (or not) where aligned; returns -1 if the kernel doesn't do that, in which
+ * case nothing changed. sys_vm_map_huge() is sys_vm_map() with the mapping
+ * aligned to, and advised for, huge pages; it quietly falls back to
+ * ordinary pages */
+#define SYS_VM_HUGE_PAGE_LOG2 (21)
+int sys_vm_advise_huge(void* p, size_t sz, int enable);
+void* sys_vm_map_huge(size_t sz);
+
 #define SYS_H
 #endif
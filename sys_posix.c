@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #include "sys.h"
 
@@ -35,3 +36,73 @@ void sys_munmap_file(struct sys_mmap_file* mf)
 {
 	munmap(mf->ptr, mf->sz);
 }
+
+void* sys_vm_reserve(size_t sz, int align_log2)
+{
+	size_t align = (size_t)1 << align_log2;
+	uint8_t* p = mmap(NULL, sz + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	// over-reserved by align bytes; trim head and tail so the result is aligned
+	uint8_t* aligned = (uint8_t*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+	size_t head = aligned - p;
+	size_t tail = align - head;
+	if (head > 0) munmap(p, head);
+	if (tail > 0) munmap(aligned + sz, tail);
+
+	return aligned;
+}
+
+void sys_vm_release(void* p, size_t sz)
+{
+	munmap(p, sz);
+}
+
+int sys_vm_commit(void* p, size_t sz)
+{
+	return mprotect(p, sz, PROT_READ | PROT_WRITE);
+}
+
+int sys_vm_decommit(void* p, size_t sz)
+{
+	/* mapping over the range (rather than MADV_DONTNEED) also frees its page
+	 * tables, which would otherwise keep huge pages from being used there */
+	if (mmap(p, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		return -1;
+	}
+	return 0;
+}
+
+void* sys_vm_map(size_t sz)
+{
+	void* p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	return p;
+}
+
+int sys_vm_advise_huge(void* p, size_t sz, int enable)
+{
+#ifdef MADV_HUGEPAGE
+	return madvise(p, sz, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#else
+	return -1;
+#endif
+}
+
+void* sys_vm_map_huge(size_t sz)
+{
+	void* p = sys_vm_reserve(sz, SYS_VM_HUGE_PAGE_LOG2);
+	if (p == NULL) {
+		return NULL;
+	}
+	sys_vm_advise_huge(p, sz, 1);
+	if (sys_vm_commit(p, sz) == -1) {
+		sys_vm_release(p, sz);
+		return NULL;
+	}
+	return p;
+}
@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <execinfo.h>
 #include <setjmp.h>
 
@@ -47,6 +48,10 @@ void ut_arghf(const char* fmt, ...) {
 }
 
 
+/* mem.c stand-ins, counting allocations and frees; mem.c's own tests define
+ * UNITTEST_REAL_MEM to test the real thing */
+#ifndef UNITTEST_REAL_MEM
+
 void* mem_alloc(size_t sz)
 {
 	void* p = malloc(sz);
@@ -65,6 +70,7 @@ void* mem_calloc(size_t sz)
 
 void* mem_realloc(void* p, size_t sz)
 {
+	if (p != NULL) ut_frees++;
 	p = realloc(p, sz);
 	AN(p);
 	ut_allocations++;
@@ -73,10 +79,17 @@ void* mem_realloc(void* p, size_t sz)
 
 void mem_free(void* p)
 {
+	if (p != NULL) ut_frees++;
 	free(p);
-	ut_frees++;
 }
 
+uint64_t mem_thread_allocs()
+{
+	return ut_allocations;
+}
+
+#endif
+
 void pre_test();
 void post_test();
 void run_tests();
@@ -11,9 +11,22 @@ void win_make_current(win_id id);
 void win_get_size(win_id id, int* width, int* height);
 void win_flip(win_id id);
 
+/* presents only the given rectangles (top left origin) when the platform
+ * can, else the whole window; n=0 also presents the whole window */
+struct win_rect {
+	int x, y, width, height;
+};
+void win_flip_damage(win_id id, const struct win_rect* rects, int n);
+
+/* age of the back buffer, i.e. how many frames ago its contents were
+ * presented; 1 if it holds the last frame, 0 if unknown */
+int win_get_buffer_age(win_id id);
+
 #define EV_KEYDOWN (1)
 #define EV_BUTTONDOWN (2)
 #define EV_BUTTONUP (3)
+#define EV_EXPOSE (4)
+#define EV_RESIZE (5)
 
 struct win_event {
 	int type;
@@ -27,11 +40,29 @@ struct win_event {
 
 		struct {
 		} move;
+
+		// area of the window that needs to be redrawn
+		struct {
+			int x, y, width, height;
+		} expose;
+
+		struct {
+			int width, height;
+		} resize;
 	};
 };
 
+/* returns 1 and fills in e if there's an event, else 0 right away. e->type
+ * is 0 for events of no interest */
 int win_poll_event(struct win_event* e);
 
+/* sleeps until there are events, win_wakeup() is called, or timeout_ms
+ * milliseconds have passed (timeout_ms < 0 waits for the first two) */
+void win_wait(int timeout_ms);
+
+// wakes up win_wait(); may be called from any thread
+void win_wakeup();
+
 
 #define WIN_H
 #endif
@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <X11/Xlib.h>
 #include <X11/XKBlib.h>
@@ -25,6 +28,16 @@ static Display* dpy = NULL;
 static XVisualInfo* vis = NULL;
 static GLXContext ctx = 0;
 
+/* partial presentation: with GLX_MESA_copy_sub_buffer the back buffer is
+ * copied to the window rectangle by rectangle, and never swapped, so it
+ * always holds the last frame. otherwise buffers are swapped, and
+ * GLX_EXT_buffer_age tells how old the back buffer's contents are */
+static PFNGLXCOPYSUBBUFFERMESAPROC copy_sub_buffer = NULL;
+static int has_buffer_age = 0;
+
+// written to by win_wakeup(), polled along with the X connection
+static int wakeup_fd = -1;
+
 
 /****************************************************
  win_* API
@@ -83,10 +96,21 @@ int win_poll_event(struct win_event* e)
 	XEvent xe;
 	XNextEvent(dpy, &xe);
 
+	e->type = 0;
 	switch (xe.type) {
+		case ConfigureNotify:
+			e->type = EV_RESIZE;
+			e->resize.width = xe.xconfigure.width;
+			e->resize.height = xe.xconfigure.height;
+			break;
 		case VisibilityNotify:
 			break;
 		case Expose:
+			e->type = EV_EXPOSE;
+			e->expose.x = xe.xexpose.x;
+			e->expose.y = xe.xexpose.y;
+			e->expose.width = xe.xexpose.width;
+			e->expose.height = xe.xexpose.height;
 			break;
 		case KeyPress: {
 			e->type = EV_KEYDOWN;
@@ -106,6 +130,42 @@ int win_poll_event(struct win_event* e)
 	return 1;
 }
 
+void win_wait(int timeout_ms)
+{
+	// XPending() flushes requests, and reads whatever already arrived
+	if (XPending(dpy)) return;
+
+	struct pollfd fds[2] = {
+		{ .fd = ConnectionNumber(dpy), .events = POLLIN },
+		{ .fd = wakeup_fd, .events = POLLIN },
+	};
+	while (poll(fds, 2, timeout_ms) == -1) {
+		if (errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fds[1].revents & POLLIN) {
+		uint64_t n;
+		// resets the counter; EAGAIN if another read got there first
+		if (read(wakeup_fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void win_wakeup()
+{
+	uint64_t one = 1;
+	// only fails (EAGAIN) if the counter is about to overflow, i.e. is set
+	if (write(wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+}
+
 void win_get_size(win_id id, int* width, int* height)
 {
 	Window _root;
@@ -121,6 +181,33 @@ void win_flip(win_id id)
 	glXSwapBuffers(dpy, id);
 }
 
+void win_flip_damage(win_id id, const struct win_rect* rects, int n)
+{
+	if (copy_sub_buffer == NULL) {
+		glXSwapBuffers(dpy, id);
+		return;
+	}
+	int width, height;
+	win_get_size(id, &width, &height);
+	if (n == 0) {
+		copy_sub_buffer(dpy, id, 0, 0, width, height);
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		const struct win_rect* r = &rects[i];
+		copy_sub_buffer(dpy, id, r->x, height - r->y - r->height, r->width, r->height);
+	}
+}
+
+int win_get_buffer_age(win_id id)
+{
+	if (copy_sub_buffer != NULL) return 1;
+	if (!has_buffer_age) return 0;
+	unsigned int age = 0;
+	glXQueryDrawable(dpy, id, GLX_BACK_BUFFER_AGE_EXT, &age);
+	return age;
+}
+
 
 /****************************************************
  main
@@ -132,9 +219,10 @@ static int is_extension_supported(const char* extensions, const char* extension)
 	const char* p1 = p0;
 	for (;;) {
 		while (*p1 != ' ' && *p1 != '\0') p1++;
-		if (memcmp(extension, p0, p1 - p0) == 0) return 1;
+		size_t n = p1 - p0;
+		if (n == strlen(extension) && memcmp(extension, p0, n) == 0) return 1;
 		if (*p1 == '\0') return 0;
-		p0 = p1++;
+		p0 = ++p1;
 	}
 }
 
@@ -283,10 +371,24 @@ int main(int argc, char** argv)
 		}
 
 		XSetErrorHandler(old_handler);
+
+		if (is_extension_supported(extensions, "GLX_MESA_copy_sub_buffer")) {
+			copy_sub_buffer = (PFNGLXCOPYSUBBUFFERMESAPROC)
+				glXGetProcAddressARB((const GLubyte*)"glXCopySubBufferMESA");
+		}
+		has_buffer_age = is_extension_supported(extensions, "GLX_EXT_buffer_age");
+	}
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd == -1) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
 	}
 
 	int exit_status = app_main(argc, argv);
 
+	close(wakeup_fd);
+
 	XCloseDisplay(dpy);
 
 	return exit_status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;